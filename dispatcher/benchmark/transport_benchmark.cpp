@@ -0,0 +1,185 @@
+#include <getopt.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "triton_client.h"
+
+// Compares patch throughput of the HTTP and gRPC transports against a running
+// Triton server, for blocking requests and for a window of async requests.
+//
+// Usage: transport-benchmark [-h http_url] [-g grpc_url] [-p patch_size]
+//                            [-N patches] [-i max_in_flight] [-B batch_size]
+//                            [-m shared_memory_regions] [-Z compression]
+//                            [-k mask_bits]
+
+namespace {
+
+// Copies the patch into a leased shared-memory region when the client has
+// them, as the dispatcher's workers read patches straight into one
+cv::Mat
+stage_patch(
+    client::TritonClient& triton_client, const cv::Mat& patch,
+    std::shared_ptr<client::SharedMemoryPool::Region>& region)
+{
+  region = triton_client.acquire_shared_memory();
+  if (!region) {
+    return patch;
+  }
+  cv::Mat staged(patch.rows, patch.cols, CV_8UC3, region->address);
+  patch.copyTo(staged);
+  return staged;
+}
+
+// Sends count patches one after the other and returns patches per second
+double
+run_blocking(
+    client::TritonClient& triton_client, const cv::Mat& patch, int count)
+{
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; ++i) {
+    std::shared_ptr<client::SharedMemoryPool::Region> region;
+    triton_client.request_inference(stage_patch(triton_client, patch, region));
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return count / elapsed.count();
+}
+
+// Sends count patches in batches, keeping the client's window of requests in
+// flight, and returns patches per second
+double
+run_async(
+    client::TritonClient& triton_client, const cv::Mat& patch, int count,
+    int batch_size)
+{
+  std::mutex mutex;
+  std::condition_variable monitor;
+  int completed = 0;
+  int failed = 0;
+
+  auto start = std::chrono::steady_clock::now();
+  for (int sent = 0; sent < count; sent += batch_size) {
+    int size = std::min(batch_size, count - sent);
+    // Only single-image requests go through shared memory
+    std::shared_ptr<client::SharedMemoryPool::Region> region;
+    std::vector<cv::Mat> batch(
+        size, size == 1 ? stage_patch(triton_client, patch, region) : patch);
+    triton_client.request_inference_async(
+        batch, [&, size, region](
+                   std::vector<cv::Mat> masks, std::exception_ptr error) {
+          std::lock_guard<std::mutex> lock(mutex);
+          completed += size;
+          failed += error ? size : 0;
+          monitor.notify_all();
+        });
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    monitor.wait(lock, [&]() { return completed == count; });
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  if (failed > 0) {
+    std::cerr << failed << " patches failed" << std::endl;
+  }
+  return count / elapsed.count();
+}
+
+void
+run_protocol(
+    const std::string& name, client::Protocol protocol, const std::string& url,
+    const cv::Mat& patch, int count, int max_in_flight, int batch_size,
+    int shared_memory_regions, const client::TransportOptions& transport)
+{
+  client::TritonClient triton_client("Segmenter", "", url, false, protocol);
+  triton_client.set_transport(transport);
+  if (shared_memory_regions > 0) {
+    size_t patch_area = patch.total();
+    triton_client.enable_shared_memory(
+        shared_memory_regions, patch_area * 3, patch_area);
+  }
+
+  // Warm up the connection and the model
+  triton_client.request_inference(patch);
+
+  double blocking = run_blocking(triton_client, patch, count);
+  triton_client.set_max_in_flight(max_in_flight);
+  double async = run_async(triton_client, patch, count, batch_size);
+
+  std::cout << name << ": " << blocking << " patches/s blocking, " << async
+            << " patches/s with " << max_in_flight << " in flight of "
+            << batch_size << std::endl;
+}
+
+}  // namespace
+
+int
+main(int argc, char** argv)
+{
+  std::string http_url("localhost:8000");
+  std::string grpc_url("localhost:8001");
+  int patch_size = 512;
+  int count = 256;
+  int max_in_flight = 8;
+  int batch_size = 1;
+  int shared_memory_regions = 0;
+  client::TransportOptions transport;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "h:g:p:N:i:B:m:Z:k:")) != -1) {
+    switch (opt) {
+      case 'h':
+        http_url = optarg;
+        break;
+      case 'g':
+        grpc_url = optarg;
+        break;
+      case 'p':
+        patch_size = std::stoi(optarg);
+        break;
+      case 'N':
+        count = std::stoi(optarg);
+        break;
+      case 'i':
+        max_in_flight = std::stoi(optarg);
+        break;
+      case 'B':
+        batch_size = std::stoi(optarg);
+        break;
+      case 'm':
+        shared_memory_regions = std::stoi(optarg);
+        break;
+      case 'Z':
+        transport.request_compression = client::parse_compression(optarg);
+        transport.response_compression = transport.request_compression;
+        break;
+      case 'k':
+        transport.mask_bits = std::stoi(optarg);
+        break;
+      default:
+        std::cerr << "Unknown option: " << opt << std::endl;
+        return -1;
+    }
+  }
+
+  // Random pixels, the model's cost does not depend on the content
+  cv::Mat patch(patch_size, patch_size, CV_8UC3);
+  cv::randu(patch, cv::Scalar(0, 0, 0), cv::Scalar(255, 255, 255));
+
+  std::cout << count << " patches of " << patch_size << " x " << patch_size
+            << std::endl;
+  run_protocol(
+      "http", client::Protocol::kHttp, http_url, patch, count, max_in_flight,
+      batch_size, shared_memory_regions, transport);
+  run_protocol(
+      "grpc", client::Protocol::kGrpc, grpc_url, patch, count, max_in_flight,
+      batch_size, shared_memory_regions, transport);
+
+  return 0;
+}
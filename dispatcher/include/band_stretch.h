@@ -0,0 +1,42 @@
+#ifndef SCENE_BAND_STRETCH_H
+#define SCENE_BAND_STRETCH_H
+
+#include <gdal_priv.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace scene {
+
+// Linear per-band stretch of 3-band pixel-interleaved samples to the 8-bit
+// range the model expects
+class BandStretch {
+ public:
+  // Constructor that maps [lows[c], highs[c]] of each band onto [0, 255]
+  BandStretch(const std::vector<float>& lows, const std::vector<float>& highs);
+
+  // Computes the stretch once for the whole scene from approximate band
+  // statistics, which GDAL takes from overviews when available. A percentile
+  // of 0 stretches between the band minimum and maximum, otherwise between
+  // the given lower and upper percentiles.
+  static BandStretch from_dataset(
+      GDALDataset* dataset, const std::vector<int>& band_map,
+      double percentile);
+
+  // Converts pixel_count interleaved RGB pixels to 8-bit
+  void apply(const uint16_t* src, uint8_t* dst, size_t pixel_count) const;
+  void apply(const float* src, uint8_t* dst, size_t pixel_count) const;
+
+ private:
+  float offsets_[3];
+  float scales_[3];
+
+  // Scalar conversion of the samples in [begin, end)
+  template <typename T>
+  void apply_scalar(const T* src, uint8_t* dst, size_t begin, size_t end) const;
+};
+
+}  // namespace scene
+
+#endif  // SCENE_BAND_STRETCH_H
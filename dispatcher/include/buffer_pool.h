@@ -0,0 +1,41 @@
+#ifndef UTILITY_BUFFER_POOL_H
+#define UTILITY_BUFFER_POOL_H
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace utility {
+
+// Recycles byte buffers, so that a steady stream of equally sized patches,
+// masks and label rows stops allocating once enough buffers are in use
+class BufferPool {
+ public:
+  // Lease of a buffer, which goes back to the pool when the last copy of the
+  // lease is gone, even if the pool is gone by then
+  using Buffer = std::shared_ptr<std::vector<uint8_t>>;
+
+  BufferPool();
+
+  BufferPool(const BufferPool&) = delete;
+  BufferPool& operator=(const BufferPool&) = delete;
+
+  // Leases a buffer of size bytes, reusing a released one when there is
+  Buffer acquire(size_t size);
+
+  // Gets how many buffers the pool has allocated so far
+  size_t get_allocated_count() const;
+
+ private:
+  struct State {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<std::vector<uint8_t>>> free_buffers;
+    size_t allocated_count = 0;
+  };
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace utility
+
+#endif  // UTILITY_BUFFER_POOL_H
@@ -0,0 +1,48 @@
+#ifndef CLIENT_CLIENT_POOL_H
+#define CLIENT_CLIENT_POOL_H
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "triton_client.h"
+
+namespace client {
+
+// Process-wide set of connected Triton clients, leased to one worker at a
+// time, so that jobs skip creating and checking clients of their own
+class ClientPool {
+ public:
+  // Creates a configured client
+  using Factory = std::function<std::unique_ptr<TritonClient>()>;
+
+  explicit ClientPool(Factory factory);
+
+  ClientPool(const ClientPool&) = delete;
+  ClientPool& operator=(const ClientPool&) = delete;
+
+  // Leases an idle client, creating another one when all are leased. The
+  // client goes back to the pool when the last copy of the lease is gone,
+  // which must happen before the pool is destroyed.
+  std::shared_ptr<TritonClient> acquire();
+
+  // Creates clients until the pool holds count of them, so that jobs find
+  // them connected
+  void reserve(int count);
+
+  // Gets how many clients the pool holds, leased or not
+  size_t get_size() const;
+
+ private:
+  Factory factory_;
+  std::vector<std::unique_ptr<TritonClient>> clients_;
+  std::vector<TritonClient*> idle_clients_;
+  mutable std::mutex mutex_;
+
+  void release(TritonClient* client);
+};
+
+}  // namespace client
+
+#endif  // CLIENT_CLIENT_POOL_H
@@ -0,0 +1,71 @@
+#ifndef CLIENT_CONCURRENCY_LIMITER_H
+#define CLIENT_CONCURRENCY_LIMITER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <utility>
+
+namespace client {
+
+// Adaptive limit on the patch requests in flight across all jobs, after the
+// AIMD limit of Netflix's concurrency-limits. The limit grows by one per
+// round trip while the smoothed round trip stays near the unloaded baseline,
+// and is cut back when it climbs past that, a sign that requests are queuing
+// on the servers, or when requests fail. Round trips are timed from the send
+// on the wire, so that requests queuing in the client do not count.
+class ConcurrencyLimiter {
+ public:
+  // Constructor that starts at initial_limit, kept within min_limit and
+  // max_limit
+  ConcurrencyLimiter(int initial_limit, int min_limit, int max_limit);
+
+  ConcurrencyLimiter(const ConcurrencyLimiter&) = delete;
+  ConcurrencyLimiter& operator=(const ConcurrencyLimiter&) = delete;
+
+  // Waits until fewer requests than the limit are in flight and takes a
+  // slot. Slots go to the highest priority waiting, first come first served
+  // within a priority.
+  void acquire(int priority = 0);
+
+  // Gives a slot back, and whether its request failed
+  void release(bool failed);
+
+  // Takes the round trip of a request to the servers
+  void add_round_trip(std::chrono::steady_clock::duration round_trip);
+
+  int get_limit() const;
+
+ private:
+  double limit_;
+  int min_limit_;
+  int max_limit_;
+  int in_flight_;
+
+  // Round trips in ms: the lowest seen, drifting up slowly so that it
+  // follows a slower model, and a moving average of the recent ones
+  double baseline_ms_;
+  double smoothed_ms_;
+
+  // Last cut, so that the requests of one congested round trip only cut once
+  std::chrono::steady_clock::time_point last_decrease_;
+
+  // Requests waiting for a slot by descending priority, then ticket
+  std::set<std::pair<int, uint64_t>> waiting_;
+  uint64_t next_ticket_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable monitor_;
+
+  // Cuts the limit by factor unless it was cut within the last round trip
+  void decrease(double factor);
+
+  // Publishes the limit and the requests in flight
+  void update_metrics() const;
+};
+
+}  // namespace client
+
+#endif  // CLIENT_CONCURRENCY_LIMITER_H
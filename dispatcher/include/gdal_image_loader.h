@@ -1,48 +1,153 @@
 #ifndef SCENE_GDAL_IMAGE_LOADER_H
 #define SCENE_GDAL_IMAGE_LOADER_H
 
+#include <cpl_virtualmem.h>
 #include <gdal_priv.h>
 
+#include <memory>
 #include <opencv2/opencv.hpp>
 #include <string>
 #include <vector>
 
+#include "band_stretch.h"
+
 namespace scene {
 
 struct ImagePatch {
+  // May be a view into the loader's memory map, valid while the loader lives
   cv::Mat image;
   cv::Rect roi;
 };
 
+// What a patch holds, as far as the model is concerned
+enum class PatchContent {
+  kData,     // Needs inference
+  kEmpty,    // Nodata or masked out everywhere
+  kUniform,  // A single colour everywhere
+};
+
+// Order patches are visited in
+enum class PatchOrder {
+  kBand,     // Row band of source blocks after row band, block by block
+  kHilbert,  // Along a Hilbert curve over the patch grid
+  kZOrder,   // Along a Z-order (Morton) curve over the patch grid
+};
+
+// Parses "band", "hilbert" or "zorder"
+PatchOrder parse_patch_order(const std::string& name);
+
 class GdalImageLoader {
  public:
   // Constructor that loads the image using GDAL and sets the patch size and
-  // stride
+  // stride. With memory_map, uncompressed 8-bit rasters are read from a file
+  // mapping instead of through the GDAL block cache, falling back to RasterIO
+  // when the layout cannot be mapped. band_map selects the 3 source bands fed
+  // to the model as RGB.
   GdalImageLoader(
-      const std::string& image_path, int patch_size, int stride_size);
+      const std::string& image_path, int patch_size, int stride_size,
+      bool memory_map = false,
+      const std::vector<int>& band_map = std::vector<int>{1, 2, 3});
 
   ~GdalImageLoader();
 
-  // Gets the coordinates of patches to process
-  std::vector<cv::Rect> get_patch_coordinates() const;
+  // Gets the coordinates of patches to process, aligned to the native block
+  // layout of the source and visited in the given order. A non-empty aoi
+  // keeps only the patches intersecting it.
+  std::vector<cv::Rect> get_patch_coordinates(
+      const cv::Rect& aoi = cv::Rect(),
+      PatchOrder order = PatchOrder::kBand) const;
+
+  // Gets non-overlapping windows covering the image, each factor times the
+  // patch size, for a downsampled pass over the scene
+  std::vector<cv::Rect> get_coarse_coordinates(
+      int factor, const cv::Rect& aoi = cv::Rect()) const;
+
+  // Converts a {min_x, min_y, max_x, max_y} bounding box in the dataset's
+  // coordinate system to the pixel window covering it, clipped to the image
+  cv::Rect get_pixel_window(const std::vector<double>& bbox) const;
+
+  // Get the affine geotransform, returning false when the image has none
+  bool get_geotransform(double* geotransform) const;
+
+  // Get the coordinate system as WKT
+  std::string get_projection() const;
 
   // Reads a patch of the image based on the given coordinates
   ImagePatch read_patch_from_coordinates(const cv::Rect& coords) const;
 
+  // Reads a patch resampled to buffer_size, using overviews when available
+  ImagePatch read_patch_from_coordinates(
+      const cv::Rect& coords, const cv::Size& buffer_size) const;
+
+  // Reads a patch resampled to the size of a caller-provided continuous
+  // CV_8UC3 buffer, e.g. one in shared memory, and returns it as the image
+  ImagePatch read_patch_into(const cv::Rect& coords, cv::Mat buffer) const;
+
+  // Checks, without decoding any pixels, whether the source has no data blocks
+  // at all under the patch (e.g. sparse GeoTIFF tiles)
+  bool is_patch_unwritten(const cv::Rect& coords) const;
+
+  // Classifies a patch that has already been read
+  PatchContent classify_patch(const ImagePatch& patch) const;
+
   // Get the image width
   int get_image_width() const;
 
   // Get the image height
   int get_image_height() const;
 
+  // Whether patches are served from a memory map of the pixel data
+  bool is_memory_mapped() const;
+
+  // Whether the source bands are wider than 8 bits and must be stretched
+  bool needs_band_stretch() const;
+
+  // Computes the scene-level stretch of non-8-bit sources (see BandStretch)
+  void init_band_stretch(double percentile);
+
+  // Shares a stretch computed by another loader of the same scene
+  std::shared_ptr<const BandStretch> get_band_stretch() const;
+  void set_band_stretch(std::shared_ptr<const BandStretch> band_stretch);
+
  private:
   std::string image_path_;
   int patch_size_;
   int stride_size_;
   GDALDataset* dataset_;
-  GDALRasterBand* red_band_;
-  GDALRasterBand* green_band_;
-  GDALRasterBand* blue_band_;
+  std::vector<int> band_map_;
+  int block_width_;
+  int block_height_;
+
+  // Native sample type of the selected bands, and the stretch applied to it
+  GDALDataType source_type_;
+  std::shared_ptr<const BandStretch> band_stretch_;
+
+  // Native samples of the last stretched patch, reused as each loader is
+  // read from a single worker
+  mutable std::vector<uint8_t> sample_buffer_;
+
+  // Reads a patch of a non-8-bit source in its native width and stretches it
+  ImagePatch read_stretched_patch(const cv::Rect& coords, cv::Mat buffer) const;
+
+  // Per-band file mappings of the pixel data, empty when not memory mapped
+  std::vector<CPLVirtualMem*> band_mappings_;
+  std::vector<const uint8_t*> band_addresses_;
+  std::vector<int> pixel_spaces_;
+  std::vector<GIntBig> line_spaces_;
+  bool pixel_interleaved_;
+
+  // Maps every selected band, returning false if any of them is not mappable
+  bool init_memory_map();
+
+  // Builds a patch from the band mappings, as a view when the mapping is
+  // already interleaved RGB and the patch spans whole lines, and as a copy
+  // otherwise
+  ImagePatch read_patch_from_memory_map(const cv::Rect& coords) const;
+
+  void release_memory_map();
+
+  // Gets the origins of windows of the given size along one axis
+  std::vector<int> get_patch_origins(int extent, int size, int stride) const;
 
   void clean_up();
 };
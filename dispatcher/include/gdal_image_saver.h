@@ -3,46 +3,149 @@
 
 #include <gdal_priv.h>
 
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
 #include <mutex>
 #include <opencv2/opencv.hpp>
 #include <string>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "soft_vote_accumulator.h"
+#include "vote_accumulator.h"
+#include "worker_thread.h"
 
 namespace scene {
 
 class GdalImageSaver {
  public:
   // Constructor initializes output path and number of classes, and applies the
-  // palette
-  GdalImageSaver(const std::string& output_path, int num_classes);
+  // palette. A non-empty compression (DEFLATE, ZSTD, LZW, ...) writes a tiled,
+  // compressed GeoTIFF with internal overviews built while rows stream out.
+  GdalImageSaver(
+      const std::string& output_path, int num_classes,
+      const std::string& compression = "");
   ~GdalImageSaver();
 
-  // Initialize GDAL datasets
-  void init_gdal(int width, int height);
+  // Set the georeferencing of the scene, applied to the output on init_gdal
+  void set_georeference(const double* geotransform, const std::string& wkt);
+
+  // Initialize GDAL datasets for a width x height scene. A non-empty window
+  // restricts the output to that part of the scene, either as a new dataset
+  // of the window's size or, with update_existing, written into an existing
+  // output of the scene's size whose overviews are rewritten over the window.
+  void init_gdal(
+      int width, int height, const cv::Rect& window = cv::Rect(),
+      bool update_existing = false);
+
+  // Blend class probabilities on a grid of scale x scale pixel cells instead
+  // of voting on labels. Call before expect_patches.
+  void set_soft_voting(int scale);
+
+  // Write only the central region of each patch, so that the regions of the
+  // registered patches tile the scene, instead of voting. Call before
+  // expect_patches.
+  void set_center_crop(bool center_crop);
+
+  // Register the patches that will be saved, so rows can be written out as
+  // soon as every patch covering them has been saved
+  void expect_patches(const std::vector<cv::Rect>& rois);
 
   // Save a patch of the image and update class counts
   void save_patch(const cv::Rect& roi, const cv::Mat& patch);
 
+  // Save the class probabilities of a patch, CV_32FC(num_classes) at any
+  // resolution, when soft voting
+  void save_probabilities(const cv::Rect& roi, const cv::Mat& probabilities);
+
+  // Write out the rows still waiting for patches, once all are saved
+  void finalize();
+
  private:
+  // Write the final soft-voted labels of the given window rows to the output
+  void write_final_rows(const std::vector<cv::Range>& row_ranges);
+
+  // Write the final voted labels of the given window regions to the output
+  void write_final_regions(const std::vector<cv::Rect>& regions);
+
+  // Write the region of a patch it owns when center cropping
+  void save_center(const cv::Rect& roi, const cv::Mat& patch);
+
+  // Queue the labels of a window region, row after row, for the writer
+  // thread, waiting for earlier writes once MAX_PENDING_WRITES are queued
+  void queue_write(const cv::Rect& region, utility::BufferPool::Buffer labels);
+
+  // Wait for a queued write, keeping its error for finalize
+  void collect_write(std::future<void>& write);
+
+  // Create empty internal overviews, down to about one tile
+  void create_overviews();
+
+  // Take the decimation factors of the overviews of an existing output
+  void read_overviews();
+
+  // Write the nearest-sampled overview pixels taken from the given final
+  // region, on the writer thread
+  void write_overview_region(const cv::Rect& region, const uint8_t* labels);
+
   // Clean up GDAL datasets
   void clean_up();
 
   // Apply grayscale palette to the output image (now called in constructor)
   void apply_palette();
 
-  // Generate a unique filename for temporary count map
-  std::string generate_uuid();
-
   // GDAL datasets and parameters
   GDALDataset* image_dataset_;
-  GDALDataset* count_dataset_;
   std::string output_path_;
-  std::string count_filename_;
+  std::string compression_;
+
+  // Decimation factor of each internal overview
+  std::vector<int> overview_factors_;
+
+  // Class votes of the rows still being worked on
+  std::unique_ptr<VoteAccumulator> votes_;
+
+  // Blended class probabilities instead of votes when soft_vote_scale_ is set
+  int soft_vote_scale_;
+  std::unique_ptr<SoftVoteAccumulator> soft_votes_;
+
+  // Center cropping, where the patch starting at crop_x_origins_[i] owns the
+  // columns [crop_x_bounds_[i], crop_x_bounds_[i + 1]), and likewise for rows
+  bool center_crop_;
+  std::vector<int> crop_x_origins_, crop_x_bounds_;
+  std::vector<int> crop_y_origins_, crop_y_bounds_;
+
+  // Single thread owning all writes to image_dataset_, fed with final rows
+  // by the workers, the writes it has not been waited for yet, and the first
+  // error of those already waited for
+  std::unique_ptr<utility::WorkerThread> writer_;
+  std::deque<std::future<void>> pending_writes_;
+  std::exception_ptr write_error_;
+  std::mutex writes_mutex_;
+
+  // Label buffers handed to the writer, and the writer's overview scratch
+  utility::BufferPool label_buffers_;
+  std::vector<uint8_t> overview_buffer_;
 
   int width_, height_;
   int num_classes_;
-  bool is_initialized_;
 
-  // Mutex for thread safety
+  // Part of the scene being written, its origin in the output dataset, and
+  // the size of that dataset
+  cv::Rect window_;
+  cv::Point output_origin_;
+  cv::Size output_size_;
+
+  // Georeferencing of the scene
+  bool has_geotransform_;
+  double geotransform_[6];
+  std::string projection_;
+  std::atomic<bool> is_initialized_;
+
+  // Mutex guarding initialization
   std::mutex init_mutex_;
 };
 
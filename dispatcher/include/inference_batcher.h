@@ -0,0 +1,90 @@
+#ifndef CLIENT_INFERENCE_BATCHER_H
+#define CLIENT_INFERENCE_BATCHER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "triton_client.h"
+
+namespace client {
+
+// Packs patches submitted from any thread, including those of concurrent
+// scenes, into batched Triton requests. A batch is sent once batch_size
+// patches of the same size and output are queued, or once the oldest of them
+// has waited for the linger time.
+class InferenceBatcher {
+ public:
+  // Completion of a single queued image, with its mask or probabilities
+  using Completion = std::function<void(cv::Mat, std::exception_ptr)>;
+
+  // Constructor that starts a sender thread keeping up to max_in_flight
+  // batches in flight asynchronously over one Triton client
+  InferenceBatcher(
+      const std::string& model_name, const std::string& model_version,
+      const std::string& server_url, bool verbose, int batch_size,
+      int linger_us, int max_in_flight, Protocol protocol = Protocol::kHttp,
+      const RoutingOptions& routing = RoutingOptions(),
+      const TransportOptions& transport = TransportOptions());
+  ~InferenceBatcher();
+
+  InferenceBatcher(const InferenceBatcher&) = delete;
+  InferenceBatcher& operator=(const InferenceBatcher&) = delete;
+
+  // Queues an image and returns a future for its mask
+  std::future<cv::Mat> request_inference(const cv::Mat& image);
+
+  // Queues an image and returns a future for its class probabilities
+  std::future<cv::Mat> request_probabilities(const cv::Mat& image);
+
+  // Queues an image, and calls done from the completion thread with its mask,
+  // or its class probabilities, once its batch is back. A mask is only valid
+  // until done returns.
+  void submit(const cv::Mat& image, bool probabilities, Completion done);
+
+  // Sets the observer of the round trips of the batches, before the first
+  // image
+  void set_latency_listener(TritonClient::LatencyListener listener);
+
+ private:
+  struct PendingImage {
+    cv::Mat image;
+    bool probabilities;
+    Completion done;
+    std::chrono::steady_clock::time_point queued_at;
+  };
+
+  int batch_size_;
+  std::chrono::microseconds linger_;
+
+  std::deque<PendingImage> queue_;
+  std::mutex mutex_;
+  std::condition_variable monitor_;
+  bool want_stop_;
+
+  std::unique_ptr<TritonClient> client_;
+  std::thread sender_;
+
+  // Queues an image with a completion fulfilling the returned future
+  std::future<cv::Mat> submit_for_future(
+      const cv::Mat& image, bool probabilities);
+
+  // Waits for the next batch due, and returns false once stopped and drained
+  bool take_batch(std::vector<PendingImage>& batch);
+
+  // Sends batches until stopped
+  void sender_loop();
+};
+
+}  // namespace client
+
+#endif  // CLIENT_INFERENCE_BATCHER_H
@@ -0,0 +1,50 @@
+#ifndef UTILITY_METRICS_H
+#define UTILITY_METRICS_H
+
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace utility {
+
+// Process-wide counters and gauges, rendered in the Prometheus text format.
+// Series are named like name or name{label="value"}, and share the help text
+// and type of their name.
+class Metrics {
+ public:
+  // Gets the process-wide instance
+  static Metrics& get();
+
+  Metrics(const Metrics&) = delete;
+  Metrics& operator=(const Metrics&) = delete;
+
+  // Adds delta to a counter, starting at 0
+  void add(const std::string& series, const std::string& help, double delta);
+
+  // Sets a gauge
+  void set(const std::string& series, const std::string& help, double value);
+
+  // Renders every series
+  std::string render() const;
+
+ private:
+  struct Family {
+    std::string help;
+    std::string type;
+    std::map<std::string, double> series;
+  };
+
+  Metrics() = default;
+
+  std::map<std::string, Family> families_;
+  mutable std::mutex mutex_;
+
+  // Gets the family of a series, creating it on first use
+  Family& get_family(
+      const std::string& series, const std::string& help,
+      const std::string& type);
+};
+
+}  // namespace utility
+
+#endif  // UTILITY_METRICS_H
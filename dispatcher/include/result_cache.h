@@ -0,0 +1,118 @@
+#ifndef CLIENT_RESULT_CACHE_H
+#define CLIENT_RESULT_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <unordered_map>
+
+#include "worker_thread.h"
+
+namespace client {
+
+// Masks of patches already segmented, keyed by a hash of the patch bytes and
+// the model, so that identical patches cost one model call. A bounded
+// in-memory tier sits in front of an optional bounded directory, both
+// evicting the least recently used masks first. Processes may share the
+// directory, its bound then applying to all of their masks together.
+class ResultCache {
+ public:
+  // 128-bit content hash
+  struct Key {
+    uint64_t high;
+    uint64_t low;
+    bool operator==(const Key& other) const
+    {
+      return high == other.high && low == other.low;
+    }
+  };
+
+  // Constructor that keeps up to memory_bytes of masks in memory and, when
+  // directory is set, up to disk_bytes in it, picking up the masks earlier
+  // processes left there
+  ResultCache(
+      const std::string& model_name, const std::string& model_version,
+      size_t memory_bytes, const std::string& directory, size_t disk_bytes);
+
+  ResultCache(const ResultCache&) = delete;
+  ResultCache& operator=(const ResultCache&) = delete;
+
+  // Gets the key of a patch
+  Key get_key(const cv::Mat& patch) const;
+
+  // Gets the mask cached for a key, or an empty Mat
+  cv::Mat find(const Key& key);
+
+  // Caches a copy of a mask
+  void insert(const Key& key, const cv::Mat& mask);
+
+ private:
+  struct KeyHash {
+    size_t operator()(const Key& key) const
+    {
+      return static_cast<size_t>(key.low);
+    }
+  };
+
+  // Entries in least recently used order, and where each key sits in it
+  template <typename Value>
+  struct Tier {
+    std::list<std::pair<Key, Value>> entries;
+    std::unordered_map<Key, typename std::list<std::pair<Key, Value>>::iterator,
+                       KeyHash>
+        index;
+    size_t bytes = 0;
+    size_t max_bytes = 0;
+  };
+
+  // Hash of the model, seeding every key
+  uint64_t model_seed_;
+
+  Tier<cv::Mat> memory_;
+  std::mutex memory_mutex_;
+
+  // Sizes of the mask files in directory_, written by disk_writer_, which
+  // also rescans the directory for the files of other processes every so
+  // many writes, and the tasks queued for it
+  std::string directory_;
+  Tier<size_t> disk_;
+  std::mutex disk_mutex_;
+  std::unique_ptr<utility::WorkerThread> disk_writer_;
+  std::atomic<int> pending_disk_tasks_{0};
+  int writes_since_scan_ = 0;
+
+  // Ends the names of the files this process is still writing
+  std::string temporary_suffix_;
+
+  // Queues a task for disk_writer_, unless too many are already queued
+  void queue_disk_task(std::function<void()> task);
+
+  // Adds a mask to the memory tier, evicting as needed
+  void insert_memory(const Key& key, const cv::Mat& mask);
+
+  // Reads and writes the mask file of a key
+  cv::Mat read_file(const Key& key) const;
+  void write_file(const Key& key, const cv::Mat& mask);
+
+  // Marks a mask file as just used, for all processes sharing directory_
+  void touch_file(const Key& key);
+
+  // Indexes the mask files in directory_ from scratch, oldest first, and
+  // evicts past the disk bound
+  void scan_directory();
+
+  // Indexes a mask file of bytes bytes, evicting the oldest files past the
+  // disk bound. The caller holds disk_mutex_.
+  void add_file(const Key& key, size_t bytes);
+
+  std::string get_path(const Key& key) const;
+};
+
+}  // namespace client
+
+#endif  // CLIENT_RESULT_CACHE_H
@@ -1,34 +1,180 @@
 #ifndef INFERENCE_SCENE_INFERENCER_H
 #define INFERENCE_SCENE_INFERENCER_H
 
+#include <functional>
 #include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
+#include "client_pool.h"
+#include "concurrency_limiter.h"
 #include "gdal_image_loader.h"
 #include "gdal_image_saver.h"
+#include "inference_batcher.h"
+#include "result_cache.h"
+#include "task_scheduler.h"
 #include "triton_client.h"
-#include "worker_thread.h"
 
 namespace inference {
 
+// Optional tuning knobs for the inference pipeline
+struct InferenceOptions {
+  // Serve patches from a memory map of uncompressed 8-bit rasters
+  bool memory_map = false;
+
+  // Skip empty (nodata, masked or unwritten) and uniform patches and fill them
+  // with empty_class instead of sending them to the model
+  bool skip_empty_patches = false;
+  int empty_class = 0;
+
+  // When above 1, segment the scene downsampled by this factor first, and run
+  // full-resolution patches only where the coarse labels are not uniform
+  int coarse_factor = 0;
+
+  // Order patches are visited in. When patch_chunk_size is above 0, threads
+  // take patches in that order this many at a time, so that the patches in
+  // flight stay within a chunk per thread along it, rather than each thread
+  // taking a contiguous share of the scene. Voted outputs are written out
+  // per output tile column as soon as no patch covers it anymore.
+  scene::PatchOrder patch_order = scene::PatchOrder::kBand;
+  int patch_chunk_size = 0;
+
+  // Source bands fed to the model as RGB
+  std::vector<int> bands = {1, 2, 3};
+
+  // Percentile clipped at both ends when stretching non-8-bit sources to
+  // 8-bit, 0 for a plain min-max stretch
+  double stretch_percentile = 0.0;
+
+  // Compression of tiled outputs with internal overviews (DEFLATE, ZSTD,
+  // LZW, ...), empty for a plain untiled GeoTIFF
+  std::string output_compression;
+
+  // When above 0, request class probabilities instead of masks and blend
+  // overlapping patches with a cosine window on a grid of this many pixels per
+  // cell, which hides seams at larger strides. The model outputs them at 1/4
+  // resolution.
+  int soft_vote_scale = 0;
+
+  // When above 1, patches of all running jobs are packed into Triton
+  // requests of up to this many images, each sent once full or once its
+  // oldest patch has waited batch_linger_us. Must not exceed the model's
+  // max_batch_size.
+  int batch_size = 1;
+  int batch_linger_us = 2000;
+
+  // When above 0, workers send patches asynchronously and move on to the next
+  // read, keeping up to this many requests (batches when batching) in flight
+  // each, with results saved from the completion callbacks
+  int max_in_flight = 0;
+
+  // Transport to the Triton server, whose URL must point at the matching
+  // endpoint (8000 for HTTP, 8001 for gRPC by default)
+  client::Protocol protocol = client::Protocol::kHttp;
+
+  // How requests are spread over the servers when the URL lists several,
+  // and when they are hedged
+  client::RoutingOptions routing;
+
+  // Compression of the request and response bodies, and whether masks come
+  // back packed at the fewest bits per pixel that hold every class, for
+  // when bandwidth to the servers is scarce
+  client::Compression request_compression = client::Compression::kNone;
+  client::Compression response_compression = client::Compression::kNone;
+  bool pack_masks = false;
+
+  // Ceiling of the adaptive limit on patch requests in flight across all
+  // jobs, which starts at one per hardware thread, grows while Triton's round
+  // trips stay near their unloaded baseline and shrinks when they climb or
+  // requests fail. Without max_in_flight, each scheduler thread waits for its
+  // request, so only max_in_flight lets the limit rise past the hardware
+  // threads.
+  int max_concurrency = 256;
+
+  // When above 0, each worker registers this many POSIX shared-memory regions
+  // with a Triton server on the same host, reads patches straight into them
+  // and gets masks back through them, so no tensor bytes cross the socket.
+  // Batched requests still go over the socket.
+  int shared_memory_regions = 0;
+
+  // When above 0, masks of patches already segmented are kept in this many MB
+  // of memory, keyed by the patch bytes and the model, and served without a
+  // model call. When cache_directory is set, they are also kept there across
+  // restarts, up to cache_disk_mb for all processes sharing the directory.
+  // Probabilities are not cached.
+  int cache_memory_mb = 0;
+  std::string cache_directory;
+  int cache_disk_mb = 1024;
+};
+
+// Per-request parameters of an inference job
+struct JobOptions {
+  // Pixel window to restrict inference to, empty for the whole scene
+  cv::Rect window;
+
+  // {min_x, min_y, max_x, max_y} in the image's coordinate system, taking
+  // precedence over window when set
+  std::vector<double> bbox;
+
+  // Write the window into an existing full-scene output instead of creating
+  // a new output of the window's size
+  bool update_output = false;
+
+  // Write only the central region of each patch instead of voting on the
+  // overlaps, for models with enough context. Regions split patch overlaps
+  // at their midpoints, i.e. a margin of (patch - stride) / 2 on each side,
+  // and extend to the scene edges.
+  bool center_crop = false;
+
+  // Relative priority against concurrent jobs, between MIN_JOB_PRIORITY and
+  // MAX_JOB_PRIORITY. Each step doubles the share of the scheduler threads a
+  // job gets while others compete. Higher priorities are admitted first when
+  // all job slots are taken, and their patch requests take the slots of the
+  // concurrency limit first. Behind the limit, batches form in arrival
+  // order.
+  int priority = 0;
+};
+
+const int MIN_JOB_PRIORITY = -4;
+const int MAX_JOB_PRIORITY = 4;
+
+// Counters reported at the end of an inference job
+struct InferenceStats {
+  int inferred_patches = 0;
+  int skipped_patches = 0;
+  int coarse_patches = 0;
+  int upsampled_patches = 0;
+};
+
+// Thrown when the model does not fit the dispatcher, as opposed to failing to
+// reach the model
+class ModelMismatchError : public std::runtime_error {
+ public:
+  using std::runtime_error::runtime_error;
+};
+
 class SceneInferencer {
  public:
   // Constructor
   SceneInferencer(
       int num_classes, const std::string& model_name,
       const std::string& model_version, const std::string& url, int patch_size,
-      int stride_size, bool verbose = true, int scaling_factor = 6)
-      : num_classes_(num_classes), model_name_(model_name),
-        model_version_(model_version), url_(url), patch_size_(patch_size),
-        stride_size_(stride_size), verbose_(verbose),
-        scaling_factor_(scaling_factor)
-  {
-  }
+      int stride_size, bool verbose = true,
+      const InferenceOptions& options = InferenceOptions());
 
   // Method to perform the inference process
-  void run_inference(
-      const std::string& image_path, const std::string& output_path);
+  InferenceStats run_inference(
+      const std::string& image_path, const std::string& output_path,
+      const JobOptions& job = JobOptions());
+
+  // Whether the model is loaded and ready on the Triton server
+  bool is_model_ready();
+
+  // Checks the model's tensors against the patches sent and the outputs
+  // expected, then warms it up with one patch. Throws ModelMismatchError on a
+  // mismatch, and other errors when the model could not be reached.
+  void check_model();
 
  private:
   int num_classes_;
@@ -38,13 +184,75 @@ class SceneInferencer {
   int patch_size_;
   int stride_size_;
   bool verbose_;
-  int scaling_factor_;
+  InferenceOptions options_;
+
+  // Transport of the tensors, derived from options_
+  client::TransportOptions transport_;
+
+  // Batches patches across workers and jobs when options_.batch_size > 1
+  std::unique_ptr<client::InferenceBatcher> batcher_;
+
+  // Connected clients shared by the workers of all jobs
+  std::unique_ptr<client::ClientPool> client_pool_;
 
-  void append_resources(
-      std::vector<std::unique_ptr<utility::WorkerThread>>& worker_threads,
-      std::vector<std::unique_ptr<client::TritonClient>>& clients,
-      std::vector<std::unique_ptr<scene::GdalImageLoader>>& loaders,
+  // Masks of patches already segmented, when options_.cache_memory_mb > 0,
+  // created once check_model learned the model version
+  std::unique_ptr<client::ResultCache> result_cache_;
+
+  // Threads running the patches of all jobs
+  std::unique_ptr<utility::TaskScheduler> scheduler_;
+
+  // Limits the patch requests in flight across all jobs
+  std::unique_ptr<client::ConcurrencyLimiter> limiter_;
+
+  // Loader and client of each scheduler thread that has worked on a job,
+  // opened on the thread's first task of the job, and the job's priority at
+  // limiter_
+  struct JobResources {
+    std::string image_path;
+    int priority = 0;
+    std::unique_ptr<scene::GdalImageLoader> scene_loader;
+    std::vector<std::unique_ptr<scene::GdalImageLoader>> loaders;
+    std::vector<std::shared_ptr<client::TritonClient>> clients;
+  };
+
+  // Creates a client configured from options_
+  std::unique_ptr<client::TritonClient> create_client();
+
+  // Gets the mask or class probabilities of a patch, through the batcher
+  // when batching or the worker's own client otherwise
+  cv::Mat request_mask(
+      client::TritonClient& client, const cv::Mat& image, int priority);
+  cv::Mat request_probabilities(
+      client::TritonClient& client, const cv::Mat& image, int priority);
+
+  // Runs a blocking patch request within a slot of limiter_
+  cv::Mat limit_concurrency(
+      int priority, const std::function<cv::Mat()>& request);
+
+  // Sends a patch without waiting for its mask or class probabilities, which
+  // are handed to done on a completion thread
+  void request_patch_async(
+      client::TritonClient& client, const cv::Mat& image, bool probabilities,
+      int priority, client::InferenceBatcher::Completion done);
+
+  // Segments the scene downsampled by options_.coarse_factor and returns the
+  // label map at that resolution
+  cv::Mat run_coarse_pass(
+      JobResources& resources, int num_workers, double weight,
+      const cv::Rect& aoi);
+
+  // Gets the class a patch can be filled with from the coarse label map, or
+  // -1 if the patch needs full-resolution inference
+  int get_coarse_class(const cv::Mat& coarse_labels, const cv::Rect& coord);
+
+  // Opens a loader of the scene, without its band stretch
+  std::unique_ptr<scene::GdalImageLoader> open_loader(
       const std::string& image_path);
+
+  // Gets the loader and client of a scheduler thread for a job
+  scene::GdalImageLoader& get_loader(JobResources& resources, int thread_id);
+  client::TritonClient& get_client(JobResources& resources, int thread_id);
 };
 
 }  // namespace inference
@@ -1,8 +1,13 @@
 #ifndef SERVICE_INFERENCE_SERVICE_H
 #define SERVICE_INFERENCE_SERVICE_H
 
+#include <atomic>
+#include <cstdint>
 #include <iostream>
+#include <set>
 #include <string>
+#include <thread>
+#include <utility>
 
 #include "httplib.h"
 #include "scene_inferencer.h"
@@ -14,34 +19,44 @@ class InferenceService {
   // Constructor that accepts Triton server address
   InferenceService(
       const std::string& triton_server_url, int patch_size, int stride_size,
-      int scaling_factor, bool verbose, int num_classes = 3,
+      bool verbose, int num_classes = 3,
       const std::string& model_name = "Segmenter",
-      const std::string& model_version = "", int max_concurrent_requests = 8)
+      const std::string& model_version = "", int max_concurrent_requests = 8,
+      const inference::InferenceOptions& options =
+          inference::InferenceOptions())
       : triton_server_url_(triton_server_url), patch_size_(patch_size),
-        stride_size_(stride_size), scaling_factor_(scaling_factor),
-        verbose_(verbose),
+        stride_size_(stride_size), verbose_(verbose),
         inferencer_(
             num_classes, model_name, model_version, triton_server_url,
-            patch_size, stride_size, verbose, scaling_factor),
+            patch_size, stride_size, verbose, options),
         server_(std::make_unique<httplib::Server>()), active_requests_(0),
-        max_concurrent_requests_(max_concurrent_requests)
+        max_concurrent_requests_(max_concurrent_requests), next_ticket_(0),
+        is_ready_(false), want_stop_(false)
   {
   }
 
-  // Start the HTTP server
+  // Stops the warm-up if it is still waiting for the model
+  ~InferenceService();
+
+  // Start the HTTP server, and the warm-up that makes the service ready
   void start(int port);
 
  private:
   std::string triton_server_url_;
   int patch_size_;
   int stride_size_;
-  int scaling_factor_;
   bool verbose_;
   int active_requests_;
   int max_concurrent_requests_;
   std::mutex inference_mutex_;
   std::condition_variable cv_;
 
+  // Requests waiting for a slot by descending priority, then ticket, so that
+  // the highest priority is admitted first and first come first served
+  // within it
+  std::set<std::pair<int, uint64_t>> waiting_requests_;
+  uint64_t next_ticket_;
+
   // HTTP server instance
   std::unique_ptr<httplib::Server> server_;
 
@@ -50,9 +65,27 @@ class InferenceService {
 
   std::mutex inferencer_mutex_;
 
+  // Set by the warm-up once the model is ready and checked out, and why the
+  // check rejected the model if it did
+  std::atomic<bool> is_ready_;
+  std::atomic<bool> want_stop_;
+  std::string model_error_;
+  std::mutex readiness_mutex_;
+  std::thread warm_up_thread_;
+
+  // Waits for the model to be ready, then checks and warms it up once
+  void warm_up();
+
+  // Handle readiness probes, 503 until the warm-up succeeded
+  void handle_readiness_request(
+      const httplib::Request& req, httplib::Response& res);
+
   // Handle inference requests
   void handle_inference_request(
       const httplib::Request& req, httplib::Response& res);
+
+  // Parse the optional per-job parameters of a request
+  inference::JobOptions parse_job_options(const httplib::Request& req);
 };
 
 }  // namespace service
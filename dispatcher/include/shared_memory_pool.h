@@ -0,0 +1,55 @@
+#ifndef CLIENT_SHARED_MEMORY_POOL_H
+#define CLIENT_SHARED_MEMORY_POOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace client {
+
+// Fixed set of POSIX shared-memory regions for exchanging tensors with a
+// Triton server on the same host. Each region holds the input of one request
+// followed by its output, and is leased to one request at a time.
+class SharedMemoryPool {
+ public:
+  struct Region {
+    // Name the region is registered under with Triton, and its shm key
+    std::string name;
+    std::string key;
+    uint8_t* address;
+    size_t input_size;
+    size_t output_size;
+  };
+
+  // Constructor that creates and maps num_regions regions of input_size plus
+  // output_size bytes each
+  SharedMemoryPool(int num_regions, size_t input_size, size_t output_size);
+  ~SharedMemoryPool();
+
+  SharedMemoryPool(const SharedMemoryPool&) = delete;
+  SharedMemoryPool& operator=(const SharedMemoryPool&) = delete;
+
+  // Leases a free region, waiting for one if all are taken. The region goes
+  // back to the pool when the last copy of the lease is gone.
+  std::shared_ptr<Region> acquire();
+
+  // Gets the region whose input area holds the size bytes at data, or null
+  const Region* find_input(const uint8_t* data, size_t size) const;
+
+  const std::vector<Region>& get_regions() const;
+
+ private:
+  std::vector<Region> regions_;
+  std::vector<int> free_regions_;
+  std::mutex mutex_;
+  std::condition_variable monitor_;
+
+  void release(int index);
+};
+
+}  // namespace client
+
+#endif  // CLIENT_SHARED_MEMORY_POOL_H
@@ -0,0 +1,95 @@
+#ifndef SCENE_SOFT_VOTE_ACCUMULATOR_H
+#define SCENE_SOFT_VOTE_ACCUMULATOR_H
+
+#include <cstdint>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+namespace scene {
+
+// In-memory blend of the class probabilities of overlapping patches, kept on
+// a grid 1/scale of the region's resolution. Each patch is weighted with a
+// cosine window that fades out towards its edges, so seams between patches
+// are hidden without deep overlaps. Full-resolution labels are the argmax of
+// the bilinearly upsampled blend. Like VoteAccumulator, grid rows only live
+// while patches covering them are outstanding or their labels are not taken.
+class SoftVoteAccumulator {
+ public:
+  // Constructor for a width x height region and the given number of classes,
+  // blended on a grid of scale x scale pixel cells
+  SoftVoteAccumulator(int width, int height, int num_classes, int scale);
+
+  // Registers a patch that will be added later, in region coordinates. The
+  // patch may extend beyond the region. Not thread-safe, call before adding
+  // starts.
+  void expect_patch(const cv::Rect& roi);
+
+  // Adds the class probabilities of a patch, CV_32FC(num_classes) at any
+  // resolution, and returns the ranges of full-resolution rows that became
+  // final
+  std::vector<cv::Range> add_probabilities(
+      const cv::Rect& roi, const cv::Mat& probabilities);
+
+  // Adds a label patch as certain probabilities of its classes
+  std::vector<cv::Range> add_labels(const cv::Rect& roi, const cv::Mat& labels);
+
+  // Makes the rows still waiting for patches final and returns them, to
+  // flush when done
+  std::vector<cv::Range> finish();
+
+  // Writes the winning class of every pixel of the given rows into labels,
+  // row after row. Rows returned by add_probabilities or finish belong to the
+  // caller that received them.
+  void take_labels(const cv::Range& rows, uint8_t* labels);
+
+ private:
+  int width_;
+  int height_;
+  int num_classes_;
+  int scale_;
+  int grid_width_;
+  int grid_height_;
+
+  // Number of expected patches still to add to each grid row
+  std::vector<int> pending_patches_;
+
+  // Whether each grid row has been normalised, guarded by the stripes
+  std::vector<uint8_t> is_final_;
+
+  // Per grid row, num_classes weighted probability sums followed by the
+  // weight sum for every cell. Normalised in place once final.
+  std::vector<std::vector<float>> grid_rows_;
+
+  // One mutex per band of grid rows, guarding the per-row state above
+  mutable std::vector<std::mutex> stripe_mutexes_;
+
+  // Final grid rows, handed out full-resolution rows, and the number of
+  // full-resolution rows still to be taken that sample each grid row
+  std::vector<uint8_t> is_ready_;
+  std::vector<uint8_t> is_handed_out_;
+  std::vector<int> dependent_rows_;
+  std::mutex ready_mutex_;
+
+  // Upper grid cell and weight of the lower one sampled by each
+  // full-resolution column
+  std::vector<int> column_cells_;
+  std::vector<float> column_weights_;
+
+  // Gets the grid cells covered by a patch, unclipped
+  cv::Rect to_grid(const cv::Rect& roi) const;
+
+  // Gets the upper grid row or column sampled by a full-resolution one and
+  // the weight of the next one
+  int get_sample_cell(int index, int grid_extent, float* weight) const;
+
+  // Normalises a grid row once nothing is added to it anymore and returns
+  // the full-resolution rows that can be taken as a result
+  std::vector<cv::Range> make_final(int grid_row);
+
+  std::mutex& get_stripe_mutex(int grid_row) const;
+};
+
+}  // namespace scene
+
+#endif  // SCENE_SOFT_VOTE_ACCUMULATOR_H
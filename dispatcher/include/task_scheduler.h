@@ -0,0 +1,103 @@
+#ifndef UTILITY_TASK_SCHEDULER_H
+#define UTILITY_TASK_SCHEDULER_H
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace utility {
+
+// Fixed set of threads, one per core, shared by every job of the process.
+// The tasks of concurrent run calls are interleaved by start-time fair
+// queuing, each call getting a share of the threads proportional to its
+// weight, so that a small job is not queued behind a large one. Within a
+// call, threads take chunks of indices in order and work forwards through
+// them. Once none are left, idle threads steal from the back of the others'
+// chunks, so that a slow task only holds up the tasks behind it until an
+// idle thread takes them.
+class TaskScheduler {
+ public:
+  // Task run for one index, with the thread it runs on, below get_size()
+  using Body = std::function<void(int thread_id, int index)>;
+
+  // Constructor that starts num_threads threads, one per hardware thread
+  // when 0
+  explicit TaskScheduler(int num_threads = 0);
+
+  // Runs the tasks still queued, then stops the threads
+  ~TaskScheduler();
+
+  TaskScheduler(const TaskScheduler&) = delete;
+  TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+  int get_size() const;
+
+  // Runs body for every index below count and waits for all of them,
+  // rethrowing the first exception thrown. Threads take chunk_size indices
+  // at a time, so that neighbouring indices tend to run on the same thread,
+  // and the indices started stay within a chunk per thread of the oldest
+  // unfinished one. Calls with twice the weight get twice the tasks started
+  // while they compete.
+  void run(int count, int chunk_size, const Body& body, double weight = 1.0);
+
+ private:
+  // Chunk of a call taken by one thread, worked through from next by the
+  // thread and from end by thieves
+  struct Run {
+    int next;
+    int end;
+  };
+
+  // Tasks of one run call, which waits for remaining to reach 0
+  struct Group {
+    const Body* body;
+    double weight;
+
+    // Virtual start time of the next task, see take_task
+    double start_tag;
+
+    // Start of the chunk to take next, and the chunk of each thread
+    int count;
+    int chunk_size;
+    int cursor;
+    std::vector<Run> runs;
+
+    int queued;
+    int remaining;
+    std::exception_ptr error;
+    std::condition_variable monitor;
+  };
+
+  struct Task {
+    Group* group;
+    int index;
+  };
+
+  std::vector<std::thread> threads_;
+
+  // Calls with tasks still queued, in the order they came in
+  std::list<Group*> groups_;
+
+  // Virtual time of the fair queue: the start tag of the last task taken
+  double virtual_time_{0.0};
+
+  std::mutex mutex_;
+  std::condition_variable monitor_;
+  bool want_stop_{false};
+
+  // Takes the queued task with the earliest start tag, preferring the
+  // thread's own chunk of its call. The caller holds mutex_.
+  bool take_task(int thread_id, Task& task);
+
+  void execute(int thread_id, const Task& task);
+
+  void thread_loop(int thread_id);
+};
+
+}  // namespace utility
+
+#endif  // UTILITY_TASK_SCHEDULER_H
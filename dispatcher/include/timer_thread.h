@@ -0,0 +1,42 @@
+#ifndef UTILITY_TIMER_THREAD_H
+#define UTILITY_TIMER_THREAD_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+namespace utility {
+
+// Runs tasks once their delay has passed, one after the other on a single
+// thread, so that waiting tasks do not hold each other up
+class TimerThread {
+ public:
+  TimerThread();
+
+  // Runs the tasks still scheduled, without waiting for their delay
+  ~TimerThread();
+
+  TimerThread(const TimerThread&) = delete;
+  TimerThread& operator=(const TimerThread&) = delete;
+
+  // Schedules a task to run after delay
+  void schedule(
+      std::chrono::steady_clock::duration delay, std::function<void()> task);
+
+ private:
+  void thread_loop();
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable monitor_;
+  bool want_stop_{false};
+  std::multimap<std::chrono::steady_clock::time_point, std::function<void()>>
+      tasks_;
+};
+
+}  // namespace utility
+
+#endif  // UTILITY_TIMER_THREAD_H
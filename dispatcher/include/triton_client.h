@@ -1,41 +1,384 @@
 #ifndef CLIENT_TRITON_CLIENT_H
 #define CLIENT_TRITON_CLIENT_H
 
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <opencv2/opencv.hpp>
 #include <string>
+#include <vector>
 
+#include "grpc_client.h"
 #include "http_client.h"
+#include "shared_memory_pool.h"
+#include "timer_thread.h"
 
 namespace tc = triton::client;
 
 namespace client {
 
+// Transport to the Triton server
+enum class Protocol { kHttp, kGrpc };
+
+// Parses "http" or "grpc"
+Protocol parse_protocol(const std::string& name);
+
+// How a request picks one of the client's endpoints
+enum class Balancing {
+  // Fewest requests outstanding, ties going to the lower latency
+  kLeastOutstanding,
+  // Lowest moving average of latency, weighted by the requests outstanding
+  kLatency
+};
+
+// Parses "least" or "latency"
+Balancing parse_balancing(const std::string& name);
+
+// How requests are spread over the endpoints of a client
+struct RoutingOptions {
+  Balancing balancing = Balancing::kLeastOutstanding;
+
+  // When above 0, a request still unanswered once this percentile of recent
+  // latencies has passed is sent again to another endpoint, and the first
+  // response wins. Requests getting their mask through shared memory are
+  // never hedged.
+  double hedge_percentile = 0;
+
+  // Time each attempt may take before it fails and counts against its
+  // endpoint, in milliseconds, or 0 to wait without limit
+  int attempt_timeout_ms = 60000;
+};
+
+// Compression of request or response bodies
+enum class Compression { kNone, kDeflate, kGzip };
+
+// Parses "none", "deflate" or "gzip"
+Compression parse_compression(const std::string& name);
+
+// Gets the name parse_compression takes
+std::string get_compression_name(Compression compression);
+
+// How tensors travel between the client and the servers
+struct TransportOptions {
+  // Compression of the request bodies, and of the response bodies over
+  // HTTP. Over gRPC, request compression applies to the stream and the
+  // server picks the compression of its responses.
+  Compression request_compression = Compression::kNone;
+  Compression response_compression = Compression::kNone;
+
+  // When above 0, masks come back packed at this many bits per pixel, 1, 2,
+  // 4 or 8 depending on the number of classes, through the packed_masks
+  // output. Masks returned through shared memory are never packed.
+  int mask_bits = 0;
+};
+
+// Gets the bits per pixel packed masks of num_classes classes take
+int get_mask_bits(int num_classes);
+
+// Name, datatype and shape of a model tensor, -1 marking variable dimensions
+struct TensorMetadata {
+  std::string name;
+  std::string datatype;
+  std::vector<int64_t> shape;
+};
+
+// Tensors of a model, as its server describes them
+struct ModelMetadata {
+  // Versions the server has loaded
+  std::vector<std::string> versions;
+  std::vector<TensorMetadata> inputs;
+  std::vector<TensorMetadata> outputs;
+};
+
 class TritonClient {
  public:
+  // Completion of an asynchronous request, given the masks or probabilities
+  // of its batch, or the error that ended it
+  using Completion =
+      std::function<void(std::vector<cv::Mat>, std::exception_ptr)>;
+
+  // Observer of the round trip of each successful attempt, from the moment
+  // it was sent, so that waiting for a slot of the client does not count
+  using LatencyListener =
+      std::function<void(std::chrono::steady_clock::duration round_trip)>;
+
   // Constructor that initializes the Triton client with model details and
-  // server URL
+  // server URLs, a comma-separated list of host:port of the servers' HTTP or
+  // gRPC endpoints. Failed requests are retried up to max_retries times,
+  // backing off exponentially with jitter up to retry_interval seconds.
   TritonClient(
       const std::string& model_name, const std::string& model_version,
-      const std::string& server_url, bool verbose, int max_retries = 32,
+      const std::string& server_url, bool verbose,
+      Protocol protocol = Protocol::kHttp, int max_retries = 32,
       int retry_interval = 4);
 
+  // Waits for the requests still in flight
+  ~TritonClient();
+
   // Runs inference on an input image and returns the resulting mask
   cv::Mat request_inference(const cv::Mat& image);
 
+  // Runs inference on a batch of equally sized images in a single request and
+  // returns their masks in order
+  std::vector<cv::Mat> request_inference(const std::vector<cv::Mat>& images);
+
+  // Runs inference on an input image and returns the class probabilities at
+  // the model's output resolution, as CV_32FC(num_classes)
+  cv::Mat request_probabilities(const cv::Mat& image);
+
+  // Batched counterpart of request_probabilities
+  std::vector<cv::Mat> request_probabilities(
+      const std::vector<cv::Mat>& images);
+
+  // Sends a batch of equally sized images without waiting for the response,
+  // blocking only while max_in_flight requests are outstanding. done runs on
+  // the client's completion thread with the masks, or the probabilities, once
+  // the request succeeded or ran out of retries. Masks view the response and
+  // are only valid until done returns, clone them to keep them. Over gRPC,
+  // requests share a single bidirectional stream.
+  void request_inference_async(
+      const std::vector<cv::Mat>& images, Completion done);
+  void request_probabilities_async(
+      const std::vector<cv::Mat>& images, Completion done);
+
+  // Whether the model is loaded and ready on any of the endpoints, false
+  // too when none of them can be reached
+  bool is_model_ready();
+
+  // Gets the model's metadata from the first endpoint it is ready on
+  ModelMetadata get_model_metadata();
+
+  // Sets how many asynchronous requests may be in flight at once
+  void set_max_in_flight(int max_in_flight);
+
+  // Sets how requests are spread over the endpoints
+  void set_routing(const RoutingOptions& routing);
+
+  // Sets how tensors travel, before the first request
+  void set_transport(const TransportOptions& transport);
+
+  // Sets the observer of round trips, before the first request
+  void set_latency_listener(LatencyListener listener);
+
+  // Registers num_regions POSIX shared-memory regions with the Triton servers,
+  // which must all be on the same host, each region holding one image of
+  // input_size bytes and its mask of output_size bytes
+  void enable_shared_memory(
+      int num_regions, size_t input_size, size_t output_size);
+
+  // Leases a shared-memory region to read a single image into, whose request
+  // then passes no tensor bytes over the socket. Null when shared memory is
+  // not enabled. Keep the lease until the request completed.
+  std::shared_ptr<SharedMemoryPool::Region> acquire_shared_memory();
+
  private:
+  // Completion of one attempt, owning the result, which is null when the
+  // attempt failed without an answer from the server
+  using AttemptCompletion =
+      std::function<void(tc::InferResult* result, const tc::Error& err)>;
+
+  // One Triton server, and what the client has seen of it
+  struct Endpoint {
+    std::string url;
+
+    // Exactly one of the clients is set, depending on protocol_
+    std::unique_ptr<tc::InferenceServerHttpClient> http_client;
+    std::unique_ptr<tc::InferenceServerGrpcClient> grpc_client;
+
+    // gRPC stream carrying this endpoint's requests, started on first use and
+    // restarted by the next request after it failed. The lock serializes
+    // starting, stopping and writing to the stream.
+    std::mutex stream_mutex;
+    bool is_stream_started = false;
+
+    // Whether the stream failed, and the completions of the requests on it by
+    // request id, both under the client's stream_mutex_
+    bool is_stream_failed = false;
+    std::map<std::string, AttemptCompletion> stream_completions;
+
+    // Attempts awaiting a response, moving average of the latency of
+    // successful ones, and failures in a row
+    int outstanding = 0;
+    double latency_ms = 0;
+    int consecutive_failures = 0;
+
+    // Circuit breaker, open until then after too many failures in a row
+    std::chrono::steady_clock::time_point open_until;
+  };
+
+  // Input and output tensors of one attempt, and the shared-memory region
+  // holding them, if any
+  struct RequestTensors {
+    std::shared_ptr<tc::InferInput> input;
+    std::shared_ptr<tc::InferRequestedOutput> output;
+    const SharedMemoryPool::Region* region = nullptr;
+    bool is_output_shared = false;
+  };
+
+  // One request, and its attempts: retries after failures and hedges
+  struct PendingRequest {
+    std::vector<cv::Mat> images;
+    std::string output_name;
+    Completion done;
+
+    // Whether the request holds a slot of the asynchronous window
+    bool holds_slot = false;
+
+    std::mutex mutex;
+    bool is_finished = false;
+    bool is_hedged = false;
+    int retries = 0;
+    int attempts_in_flight = 0;
+  };
+
   std::string model_name_;
   std::string model_version_;
-  std::string server_url_;
   bool verbose_;
   int max_retries_;
   int retry_interval_;
+  Protocol protocol_;
+
+  std::vector<std::unique_ptr<Endpoint>> endpoints_;
+  RoutingOptions routing_;
+  TransportOptions transport_;
+  LatencyListener latency_listener_;
+  std::mutex endpoints_mutex_;
+
+  // Latencies of recent successful attempts over all endpoints, and the
+  // hedging threshold taken from them
+  std::vector<double> latency_samples_;
+  size_t next_latency_sample_;
+  std::vector<double> hedge_samples_;
+  double hedge_threshold_ms_;
+
+  // Id of the next request on the gRPC streams, and the lock of their
+  // completions, never held while calling into a client
+  uint64_t next_request_id_;
+  std::mutex stream_mutex_;
+
+  // Regions registered with the servers, when enabled
+  std::unique_ptr<SharedMemoryPool> shared_memory_;
+
+  // Window of asynchronous requests, and the requests of any kind not yet
+  // destroyed, which the destructor waits for
+  int max_in_flight_;
+  int in_flight_;
+  int live_requests_;
+  std::mutex in_flight_mutex_;
+  std::condition_variable in_flight_monitor_;
+
+  // Runs retries after their backoff and hedges after their threshold, off
+  // the completion threads
+  std::unique_ptr<utility::TimerThread> timer_;
+
+  // Creates a request, counted as live until it is destroyed
+  std::shared_ptr<PendingRequest> create_request(
+      const std::vector<cv::Mat>& images, const std::string& output_name,
+      Completion done);
+
+  // Sends a batch of images to the model and waits for the named output of
+  // each image
+  std::vector<cv::Mat> infer(
+      const std::vector<cv::Mat>& images, const std::string& output_name);
+
+  // Takes a slot of the in-flight window and sends a batch asynchronously
+  void infer_async(
+      const std::vector<cv::Mat>& images, const std::string& output_name,
+      Completion done);
+
+  // Sends one attempt of a request to the best endpoint other than avoid,
+  // if there is another
+  void send_attempt(
+      const std::shared_ptr<PendingRequest>& request, const Endpoint* avoid);
+
+  // Takes the outcome of an attempt, finishing the request on success and
+  // retrying it once no other attempt is left in flight on failure
+  void on_attempt_result(
+      const std::shared_ptr<PendingRequest>& request, Endpoint* endpoint,
+      const RequestTensors& tensors,
+      std::chrono::steady_clock::time_point sent_at,
+      std::shared_ptr<tc::InferResult> result, const tc::Error& err);
+
+  // Runs the completion of a request just marked finished, and gives back
+  // its slot
+  void finish_request(
+      PendingRequest& request, std::vector<cv::Mat> outputs,
+      std::exception_ptr error);
+
+  // Sends a hedge of a request still unanswered, away from the endpoint its
+  // first attempt went to
+  void hedge_request(
+      const std::shared_ptr<PendingRequest>& request, const Endpoint* first);
+
+  // Picks the endpoint for an attempt and counts it as outstanding there.
+  // Endpoints with an open circuit are only picked when all circuits are
+  // open, the one closing first then getting a trial attempt.
+  Endpoint* acquire_endpoint(const Endpoint* avoid);
+
+  // Records the outcome of an attempt at an endpoint
+  void release_endpoint(Endpoint* endpoint, bool is_ok, double latency_ms);
+
+  // Gets the latency after which requests are hedged, or 0 when not hedging
+  // or too few latencies were seen yet
+  double get_hedge_threshold_ms();
+
+  // Gets the time each attempt may take, or 0 for no limit
+  std::chrono::microseconds get_attempt_timeout();
+
+  // Gets the jittered delay before the given retry
+  std::chrono::milliseconds get_backoff(int retry) const;
+
+  // Sends one asynchronous attempt to an endpoint over the selected transport
+  tc::Error async_infer_once(
+      Endpoint& endpoint, AttemptCompletion callback, tc::InferOptions options,
+      const std::vector<tc::InferInput*>& inputs,
+      const std::vector<const tc::InferRequestedOutput*>& outputs);
+
+  // Routes a result of a gRPC stream to its request's completion, or fails
+  // the stream when the result reports its end
+  void on_stream_result(Endpoint& endpoint, tc::InferResult* result);
+
+  // Fails all requests on the gRPC stream of an endpoint, and marks the
+  // stream to be restarted by the next request
+  void fail_stream(Endpoint& endpoint, const tc::Error& err);
+
+  // Fails a request on the gRPC stream of an endpoint if still unanswered
+  void expire_stream_request(Endpoint& endpoint, const std::string& request_id);
+
+  // Builds the tensors of a batch of equally sized images, requesting the
+  // named output
+  RequestTensors create_tensors(
+      const std::vector<cv::Mat>& images, const std::string& output_name) const;
+
+  // Extracts the requested output of a batch from a result, masks as views
+  // into the result or the shared-memory region
+  std::vector<cv::Mat> get_outputs(
+      const std::shared_ptr<tc::InferResult>& result,
+      const std::vector<cv::Mat>& images, const RequestTensors& tensors) const;
+
+  // Counts the bytes of an output on the wire
+  void count_output_bytes(
+      const std::string& output, const uint8_t* data, size_t size) const;
+
+  // Helper function to view the masks of a batch in Triton inference result
+  std::vector<cv::Mat> get_masks(
+      const std::shared_ptr<tc::InferResult>& result,
+      const std::vector<cv::Mat>& images) const;
 
-  std::unique_ptr<tc::InferenceServerHttpClient> client_;
+  // Helper function to unpack the packed masks of a batch from Triton
+  // inference result
+  std::vector<cv::Mat> get_packed_masks(
+      const std::shared_ptr<tc::InferResult>& result,
+      const std::vector<cv::Mat>& images) const;
 
-  // Helper function to extract mask from Triton inference result
-  cv::Mat get_mask(
-      const std::shared_ptr<tc::InferResult>& result, int rows, int cols) const;
+  // Helper function to extract the class probabilities of a batch of count
+  // images from Triton inference result
+  std::vector<cv::Mat> get_probabilities(
+      const std::shared_ptr<tc::InferResult>& result, size_t count) const;
 };
 
 }  // namespace client
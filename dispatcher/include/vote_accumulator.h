@@ -0,0 +1,85 @@
+#ifndef SCENE_VOTE_ACCUMULATOR_H
+#define SCENE_VOTE_ACCUMULATOR_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <opencv2/opencv.hpp>
+#include <vector>
+
+#include "vote_kernels.h"
+
+namespace scene {
+
+// In-memory per-pixel class votes of overlapping patches, tracked in row
+// segments of a column of the region each. Segments are allocated when first
+// voted on and released once every expected patch covering them has been
+// voted, so memory follows the area still being worked on rather than the
+// scene area, in whatever order patches come. Voting is thread-safe and
+// striped by row bands, so patches in different bands never contend.
+class VoteAccumulator {
+ public:
+  // Constructor for a width x height region and the given number of classes,
+  // with counters sized for at most max_votes votes per pixel, in columns of
+  // column_width pixels, the whole width when 0
+  VoteAccumulator(
+      int width, int height, int num_classes, int max_votes,
+      int column_width = 0);
+
+  // Registers a patch that will be voted later, in region coordinates. Not
+  // thread-safe, call before voting starts.
+  void expect_patch(const cv::Rect& roi);
+
+  // Adds the votes of a patch and returns the regions that became final, i.e.
+  // that no expected patch will vote on anymore, each spanning one column
+  std::vector<cv::Rect> add_votes(const cv::Rect& roi, const cv::Mat& patch);
+
+  // Gets the regions that are not final yet, to flush when done
+  std::vector<cv::Rect> get_pending_regions() const;
+
+  // Writes the winning class of every pixel of a region returned above into
+  // labels, row after row, and releases their counts. Regions returned by
+  // add_votes belong to the caller that received them.
+  void take_labels(const cv::Rect& region, uint8_t* labels);
+
+  // Number of row segments currently holding counts
+  int get_resident_segments() const;
+
+ private:
+  int width_;
+  int height_;
+  int num_classes_;
+  int column_width_;
+  int num_columns_;
+
+  // Number of expected patches still to vote on each segment, indexed by
+  // row * num_columns_ + column like the state below
+  std::vector<int> pending_patches_;
+
+  // Whether each segment has been handed out by take_labels, one byte per
+  // segment so rows in different stripes can be updated concurrently
+  std::vector<uint8_t> is_final_;
+
+  // Vote update and argmax, specialised on class count and counter width
+  VoteKernel kernel_;
+
+  // Per-segment counters in the kernel's class-planar layout. Empty while a
+  // segment has no votes or once it has been taken.
+  std::vector<std::vector<uint8_t>> segment_counts_;
+  std::atomic<int> resident_segments_;
+
+  // One mutex per band of rows, guarding the per-segment state above
+  mutable std::vector<std::mutex> stripe_mutexes_;
+
+  std::mutex& get_stripe_mutex(int row) const;
+
+  // Gets the columns the pixels x to x + width - 1 fall in, as a range
+  cv::Range get_columns(int x, int width) const;
+
+  // Gets the pixels of a column, as a range
+  cv::Range get_column_span(int column) const;
+};
+
+}  // namespace scene
+
+#endif  // SCENE_VOTE_ACCUMULATOR_H
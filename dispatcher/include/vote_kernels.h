@@ -0,0 +1,33 @@
+#ifndef SCENE_VOTE_KERNELS_H
+#define SCENE_VOTE_KERNELS_H
+
+#include <cstdint>
+
+namespace scene {
+
+// Vote counters of a row are class-planar: num_classes planes of width
+// counters each, so that updates and argmax run across pixels in SIMD lanes.
+
+// Adds one vote for labels[i] to the pixel at offset + i, for i < count
+using AddVotesFn = void (*)(
+    const uint8_t* labels, void* counts, int offset, int count, int width,
+    int num_classes);
+
+// Writes the class with the most votes of every pixel, ties going to the
+// lowest class
+using ArgmaxFn = void (*)(
+    const void* counts, uint8_t* labels, int width, int num_classes);
+
+struct VoteKernel {
+  AddVotesFn add_votes;
+  ArgmaxFn argmax;
+  int counter_size;  // Bytes per counter
+};
+
+// Picks the narrowest counters that hold max_votes, and a kernel specialised
+// for 2, 3, 4 or 8 classes when num_classes is one of them
+VoteKernel get_vote_kernel(int num_classes, int max_votes);
+
+}  // namespace scene
+
+#endif  // SCENE_VOTE_KERNELS_H
@@ -0,0 +1,197 @@
+#include "band_stretch.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace scene {
+
+namespace {
+
+const int NUM_CHANNELS = 3;
+const int HISTOGRAM_BUCKETS = 1024;
+
+#if defined(__SSE2__)
+// Samples handled per SIMD step: 16 pixels of 3 channels, which is a whole
+// number of 4-lane float vectors and of 16-byte output stores
+const size_t SIMD_STEP = 48;
+
+// Stretches 12 float vectors and stores them as 48 bytes. Since 3 channels do
+// not divide 4 lanes, the per-channel parameters repeat every 3 vectors.
+inline void
+stretch_step(
+    __m128 (&values)[12], const __m128 (&offsets)[3],
+    const __m128 (&scales)[3], uint8_t* dst)
+{
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 max_value = _mm_set1_ps(255.0f);
+
+  __m128i words[12];
+  for (int k = 0; k < 12; ++k) {
+    __m128 v = _mm_mul_ps(_mm_sub_ps(values[k], offsets[k % 3]), scales[k % 3]);
+    v = _mm_min_ps(_mm_max_ps(v, zero), max_value);
+    words[k] = _mm_cvtps_epi32(v);
+  }
+  for (int g = 0; g < 3; ++g) {
+    __m128i low = _mm_packs_epi32(words[4 * g], words[4 * g + 1]);
+    __m128i high = _mm_packs_epi32(words[4 * g + 2], words[4 * g + 3]);
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(dst + 16 * g), _mm_packus_epi16(low, high));
+  }
+}
+#endif
+
+}  // namespace
+
+BandStretch::BandStretch(
+    const std::vector<float>& lows, const std::vector<float>& highs)
+{
+  if (lows.size() != NUM_CHANNELS || highs.size() != NUM_CHANNELS) {
+    throw std::runtime_error("Band stretch requires exactly 3 bands.");
+  }
+
+  for (int c = 0; c < NUM_CHANNELS; ++c) {
+    float range = highs[c] - lows[c];
+    offsets_[c] = lows[c];
+    scales_[c] = range > 0.0f ? 255.0f / range : 0.0f;
+  }
+}
+
+BandStretch
+BandStretch::from_dataset(
+    GDALDataset* dataset, const std::vector<int>& band_map, double percentile)
+{
+  std::vector<float> lows;
+  std::vector<float> highs;
+
+  for (int band_index : band_map) {
+    GDALRasterBand* band = dataset->GetRasterBand(band_index);
+    double min, max, mean, stddev;
+    if (band->ComputeStatistics(
+            TRUE, &min, &max, &mean, &stddev, nullptr, nullptr) != CE_None) {
+      throw std::runtime_error(
+          "Failed to compute statistics of band " +
+          std::to_string(band_index));
+    }
+
+    if (percentile > 0.0 && max > min) {
+      // Clip both tails of an approximate histogram
+      std::vector<GUIntBig> histogram(HISTOGRAM_BUCKETS, 0);
+      band->GetHistogram(
+          min, max, HISTOGRAM_BUCKETS, histogram.data(), FALSE, TRUE, nullptr,
+          nullptr);
+
+      GUIntBig total = 0;
+      for (GUIntBig count : histogram) {
+        total += count;
+      }
+
+      double bucket_width = (max - min) / HISTOGRAM_BUCKETS;
+      GUIntBig low_target = static_cast<GUIntBig>(total * percentile / 100.0);
+      GUIntBig high_target =
+          static_cast<GUIntBig>(total * (100.0 - percentile) / 100.0);
+      GUIntBig cumulative = 0;
+      double low = min, high = max;
+      bool found_low = false;
+      for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        cumulative += histogram[i];
+        if (!found_low && cumulative > low_target) {
+          low = min + i * bucket_width;
+          found_low = true;
+        }
+        if (cumulative >= high_target) {
+          high = min + (i + 1) * bucket_width;
+          break;
+        }
+      }
+      min = low;
+      max = high;
+    }
+
+    lows.push_back(static_cast<float>(min));
+    highs.push_back(static_cast<float>(max));
+  }
+
+  return BandStretch(lows, highs);
+}
+
+void
+BandStretch::apply(const uint16_t* src, uint8_t* dst, size_t pixel_count) const
+{
+  size_t sample_count = pixel_count * NUM_CHANNELS;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128 offsets[3] = {
+      _mm_setr_ps(offsets_[0], offsets_[1], offsets_[2], offsets_[0]),
+      _mm_setr_ps(offsets_[1], offsets_[2], offsets_[0], offsets_[1]),
+      _mm_setr_ps(offsets_[2], offsets_[0], offsets_[1], offsets_[2])};
+  const __m128 scales[3] = {
+      _mm_setr_ps(scales_[0], scales_[1], scales_[2], scales_[0]),
+      _mm_setr_ps(scales_[1], scales_[2], scales_[0], scales_[1]),
+      _mm_setr_ps(scales_[2], scales_[0], scales_[1], scales_[2])};
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; i + SIMD_STEP <= sample_count; i += SIMD_STEP) {
+    // Widen 6 vectors of 8 unsigned 16-bit samples to 12 float vectors
+    __m128 values[12];
+    for (int k = 0; k < 6; ++k) {
+      __m128i words =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + 8 * k));
+      values[2 * k] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero));
+      values[2 * k + 1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(words, zero));
+    }
+    stretch_step(values, offsets, scales, dst + i);
+  }
+#endif
+
+  apply_scalar(src, dst, i, sample_count);
+}
+
+void
+BandStretch::apply(const float* src, uint8_t* dst, size_t pixel_count) const
+{
+  size_t sample_count = pixel_count * NUM_CHANNELS;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128 offsets[3] = {
+      _mm_setr_ps(offsets_[0], offsets_[1], offsets_[2], offsets_[0]),
+      _mm_setr_ps(offsets_[1], offsets_[2], offsets_[0], offsets_[1]),
+      _mm_setr_ps(offsets_[2], offsets_[0], offsets_[1], offsets_[2])};
+  const __m128 scales[3] = {
+      _mm_setr_ps(scales_[0], scales_[1], scales_[2], scales_[0]),
+      _mm_setr_ps(scales_[1], scales_[2], scales_[0], scales_[1]),
+      _mm_setr_ps(scales_[2], scales_[0], scales_[1], scales_[2])};
+
+  for (; i + SIMD_STEP <= sample_count; i += SIMD_STEP) {
+    __m128 values[12];
+    for (int k = 0; k < 12; ++k) {
+      values[k] = _mm_loadu_ps(src + i + 4 * k);
+    }
+    stretch_step(values, offsets, scales, dst + i);
+  }
+#endif
+
+  apply_scalar(src, dst, i, sample_count);
+}
+
+template <typename T>
+void
+BandStretch::apply_scalar(
+    const T* src, uint8_t* dst, size_t begin, size_t end) const
+{
+  // begin is always a whole number of pixels, so channels stay in phase
+  for (size_t i = begin; i < end; ++i) {
+    int c = i % NUM_CHANNELS;
+    float v = (static_cast<float>(src[i]) - offsets_[c]) * scales_[c];
+    v = std::min(std::max(v, 0.0f), 255.0f);
+    dst[i] = static_cast<uint8_t>(v + 0.5f);
+  }
+}
+
+}  // namespace scene
@@ -0,0 +1,41 @@
+#include "buffer_pool.h"
+
+namespace utility {
+
+BufferPool::BufferPool() : state_(std::make_shared<State>()) {}
+
+BufferPool::Buffer
+BufferPool::acquire(size_t size)
+{
+  std::unique_ptr<std::vector<uint8_t>> buffer;
+  {
+    std::lock_guard<std::mutex> lock(state_->mutex);
+    if (!state_->free_buffers.empty()) {
+      buffer = std::move(state_->free_buffers.back());
+      state_->free_buffers.pop_back();
+    } else {
+      state_->allocated_count++;
+    }
+  }
+  if (!buffer) {
+    buffer = std::make_unique<std::vector<uint8_t>>();
+  }
+
+  // Only grows the buffer's storage the first time it sees a larger size
+  buffer->resize(size);
+
+  std::shared_ptr<State> state = state_;
+  return Buffer(buffer.release(), [state](std::vector<uint8_t>* released) {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    state->free_buffers.emplace_back(released);
+  });
+}
+
+size_t
+BufferPool::get_allocated_count() const
+{
+  std::lock_guard<std::mutex> lock(state_->mutex);
+  return state_->allocated_count;
+}
+
+}  // namespace utility
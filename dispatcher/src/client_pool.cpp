@@ -0,0 +1,56 @@
+#include "client_pool.h"
+
+namespace client {
+
+ClientPool::ClientPool(Factory factory) : factory_(std::move(factory)) {}
+
+std::shared_ptr<TritonClient>
+ClientPool::acquire()
+{
+  TritonClient* client = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_clients_.empty()) {
+      client = idle_clients_.back();
+      idle_clients_.pop_back();
+    }
+  }
+
+  // Created outside the lock, as it talks to the server
+  if (!client) {
+    std::unique_ptr<TritonClient> created = factory_();
+    client = created.get();
+    std::lock_guard<std::mutex> lock(mutex_);
+    clients_.push_back(std::move(created));
+  }
+
+  return std::shared_ptr<TritonClient>(
+      client, [this](TritonClient* leased) { release(leased); });
+}
+
+void
+ClientPool::reserve(int count)
+{
+  while (static_cast<int>(get_size()) < count) {
+    std::unique_ptr<TritonClient> created = factory_();
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_clients_.push_back(created.get());
+    clients_.push_back(std::move(created));
+  }
+}
+
+size_t
+ClientPool::get_size() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return clients_.size();
+}
+
+void
+ClientPool::release(TritonClient* client)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  idle_clients_.push_back(client);
+}
+
+}  // namespace client
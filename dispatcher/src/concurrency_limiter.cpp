@@ -0,0 +1,137 @@
+#include "concurrency_limiter.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "metrics.h"
+
+namespace client {
+
+namespace {
+
+// Smoothed round trip, relative to the baseline, past which requests are
+// taken to be queuing
+const double LATENCY_TOLERANCE = 2.0;
+
+// Cuts of the limit on queuing and on failures
+const double LATENCY_BACKOFF = 0.9;
+const double FAILURE_BACKOFF = 0.5;
+
+// Weight of a new round trip in the moving average, and the share of the
+// gap above it the baseline drifts up by
+const double SMOOTHING = 0.1;
+const double BASELINE_DRIFT = 0.001;
+
+}  // namespace
+
+ConcurrencyLimiter::ConcurrencyLimiter(
+    int initial_limit, int min_limit, int max_limit)
+    : limit_(initial_limit), min_limit_(min_limit), max_limit_(max_limit),
+      in_flight_(0), baseline_ms_(0.0), smoothed_ms_(0.0), next_ticket_(0)
+{
+  if (min_limit_ < 1 || max_limit_ < min_limit_) {
+    throw std::runtime_error("Invalid concurrency limits.");
+  }
+  limit_ = std::min<double>(std::max(initial_limit, min_limit_), max_limit_);
+  update_metrics();
+}
+
+void
+ConcurrencyLimiter::acquire(int priority)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto waiting = waiting_.emplace(-priority, next_ticket_++).first;
+  monitor_.wait(lock, [this, waiting] {
+    return in_flight_ < static_cast<int>(limit_) && waiting_.begin() == waiting;
+  });
+  waiting_.erase(waiting);
+  in_flight_++;
+  update_metrics();
+
+  // The next in line may find a slot still free
+  bool is_slot_free =
+      !waiting_.empty() && in_flight_ < static_cast<int>(limit_);
+  lock.unlock();
+  if (is_slot_free) {
+    monitor_.notify_all();
+  }
+}
+
+void
+ConcurrencyLimiter::release(bool failed)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    in_flight_--;
+    if (failed) {
+      decrease(FAILURE_BACKOFF);
+    }
+    update_metrics();
+  }
+  monitor_.notify_all();
+}
+
+void
+ConcurrencyLimiter::add_round_trip(
+    std::chrono::steady_clock::duration round_trip)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    double round_trip_ms =
+        std::chrono::duration<double, std::milli>(round_trip).count();
+    if (baseline_ms_ == 0.0 || round_trip_ms < baseline_ms_) {
+      baseline_ms_ = round_trip_ms;
+    } else {
+      baseline_ms_ += (round_trip_ms - baseline_ms_) * BASELINE_DRIFT;
+    }
+    smoothed_ms_ =
+        smoothed_ms_ == 0.0
+            ? round_trip_ms
+            : smoothed_ms_ + (round_trip_ms - smoothed_ms_) * SMOOTHING;
+
+    if (smoothed_ms_ > baseline_ms_ * LATENCY_TOLERANCE) {
+      decrease(LATENCY_BACKOFF);
+    } else if (in_flight_ * 2 >= limit_) {
+      // One more per round trip's worth of completions, and only while the
+      // limit is what holds requests back
+      limit_ = std::min<double>(limit_ + 1.0 / limit_, max_limit_);
+    }
+    update_metrics();
+  }
+  monitor_.notify_all();
+}
+
+int
+ConcurrencyLimiter::get_limit() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return static_cast<int>(limit_);
+}
+
+void
+ConcurrencyLimiter::decrease(double factor)
+{
+  auto now = std::chrono::steady_clock::now();
+  auto round_trip = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::duration<double, std::milli>(smoothed_ms_));
+  if (now - last_decrease_ < round_trip) {
+    return;
+  }
+  last_decrease_ = now;
+  limit_ = std::max<double>(limit_ * factor, min_limit_);
+}
+
+void
+ConcurrencyLimiter::update_metrics() const
+{
+  utility::Metrics& metrics = utility::Metrics::get();
+  metrics.set(
+      "dispatcher_concurrency_limit",
+      "Adaptive limit on patch requests in flight.",
+      static_cast<int>(limit_));
+  metrics.set(
+      "dispatcher_concurrency_in_flight", "Patch requests in flight.",
+      in_flight_);
+}
+
+}  // namespace client
@@ -1,17 +1,85 @@
 #include "gdal_image_loader.h"
 
+#include <cpl_string.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
+#include <limits>
 #include <stdexcept>
+#include <utility>
 
 namespace fs = std::filesystem;
 
 namespace scene {
 
+namespace {
+
+// Distance along the Hilbert curve filling a size x size grid, size being a
+// power of two
+uint64_t
+get_hilbert_index(uint32_t size, uint32_t x, uint32_t y)
+{
+  uint64_t index = 0;
+  for (uint32_t s = size / 2; s > 0; s /= 2) {
+    uint32_t rx = (x & s) > 0;
+    uint32_t ry = (y & s) > 0;
+    index += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+    // Rotate the quadrant so that the curve runs on through it
+    if (ry == 0) {
+      if (rx == 1) {
+        x = size - 1 - x;
+        y = size - 1 - y;
+      }
+      std::swap(x, y);
+    }
+  }
+  return index;
+}
+
+// Interleaves the bits of x and y
+uint64_t
+get_morton_index(uint32_t x, uint32_t y)
+{
+  uint64_t index = 0;
+  for (int bit = 0; bit < 32; ++bit) {
+    index |= static_cast<uint64_t>((x >> bit) & 1) << (2 * bit);
+    index |= static_cast<uint64_t>((y >> bit) & 1) << (2 * bit + 1);
+  }
+  return index;
+}
+
+}  // namespace
+
+PatchOrder
+parse_patch_order(const std::string& name)
+{
+  if (name == "band") {
+    return PatchOrder::kBand;
+  }
+  if (name == "hilbert") {
+    return PatchOrder::kHilbert;
+  }
+  if (name == "zorder") {
+    return PatchOrder::kZOrder;
+  }
+  throw std::invalid_argument("Unknown patch order: " + name);
+}
+
 GdalImageLoader::GdalImageLoader(
-    const std::string& image_path, int patch_size, int stride_size)
+    const std::string& image_path, int patch_size, int stride_size,
+    bool memory_map, const std::vector<int>& band_map)
     : image_path_(image_path), patch_size_(patch_size),
-      stride_size_(stride_size), dataset_(nullptr)
+      stride_size_(stride_size), dataset_(nullptr), band_map_(band_map),
+      block_width_(0), block_height_(0), source_type_(GDT_Byte),
+      pixel_interleaved_(false)
 {
+  if (band_map_.size() != 3) {
+    throw std::runtime_error("Exactly 3 bands must be selected.");
+  }
+
   // Check if the image path exists
   if (!fs::exists(image_path)) {
     throw std::runtime_error("Image path does not exist: " + image_path);
@@ -24,13 +92,31 @@ GdalImageLoader::GdalImageLoader(
     throw std::runtime_error("Failed to open the image with GDAL.");
   }
 
-  // Get the raster bands for the RGB channels
-  red_band_ = dataset_->GetRasterBand(1);
-  green_band_ = dataset_->GetRasterBand(2);
-  blue_band_ = dataset_->GetRasterBand(3);
+  // Check the raster bands for the RGB channels
+  for (int band_index : band_map_) {
+    if (band_index < 1 || band_index > dataset_->GetRasterCount()) {
+      throw std::runtime_error(
+          "Failed to retrieve the required raster bands.");
+    }
+  }
+
+  // Use the widest sample type among the selected bands
+  for (int band_index : band_map_) {
+    GDALDataType band_type =
+        dataset_->GetRasterBand(band_index)->GetRasterDataType();
+    if (GDALGetDataTypeSizeBytes(band_type) >
+        GDALGetDataTypeSizeBytes(source_type_)) {
+      source_type_ = band_type;
+    }
+  }
 
-  if (!red_band_ || !green_band_ || !blue_band_) {
-    throw std::runtime_error("Failed to retrieve the required raster bands.");
+  // Get the native block layout (tile or strip size) of the source
+  dataset_->GetRasterBand(band_map_[0])
+      ->GetBlockSize(&block_width_, &block_height_);
+
+  // Fall back to RasterIO when the layout cannot be mapped
+  if (memory_map && !init_memory_map()) {
+    release_memory_map();
   }
 }
 
@@ -39,48 +125,324 @@ GdalImageLoader::~GdalImageLoader()
   clean_up();
 }
 
+std::vector<int>
+GdalImageLoader::get_patch_origins(int extent, int size, int stride) const
+{
+  // The last window is clamped to the image edge and the walk stops there, so
+  // no window is read twice
+  std::vector<int> origins;
+  for (int pos = 0;; pos += stride) {
+    if (pos + size >= extent) {
+      origins.push_back(std::max(0, extent - size));
+      break;
+    }
+    origins.push_back(pos);
+  }
+  return origins;
+}
+
 std::vector<cv::Rect>
-GdalImageLoader::get_patch_coordinates() const
+GdalImageLoader::get_patch_coordinates(
+    const cv::Rect& aoi, PatchOrder order) const
+{
+  int image_width = dataset_->GetRasterXSize();
+  int image_height = dataset_->GetRasterYSize();
+
+  // Snap the stride down to a multiple of the block size, so patch origins
+  // fall on block boundaries. Strips wider than the stride are left as is.
+  auto align_stride = [this](int block_size) {
+    if (block_size <= 0 || block_size > stride_size_) {
+      return stride_size_;
+    }
+    return stride_size_ - stride_size_ % block_size;
+  };
+  std::vector<int> origins_x = get_patch_origins(
+      image_width, patch_size_, align_stride(block_width_));
+  std::vector<int> origins_y = get_patch_origins(
+      image_height, patch_size_, align_stride(block_height_));
+
+  // Side of the power-of-two grid the curves fill
+  uint32_t grid_size = 1;
+  while (grid_size < std::max(origins_x.size(), origins_y.size())) {
+    grid_size *= 2;
+  }
+  int block_width = std::max(block_width_, 1);
+  int block_height = std::max(block_height_, 1);
+
+  // Calculate the coordinates of each patch, with its place in the order
+  std::vector<std::pair<uint64_t, cv::Rect>> patches;
+  for (size_t row = 0; row < origins_y.size(); ++row) {
+    for (size_t col = 0; col < origins_x.size(); ++col) {
+      cv::Rect patch(origins_x[col], origins_y[row], patch_size_, patch_size_);
+      if (!aoi.empty() && (patch & aoi).empty()) {
+        continue;
+      }
+
+      uint64_t key;
+      if (order == PatchOrder::kHilbert) {
+        key = get_hilbert_index(grid_size, col, row);
+      } else if (order == PatchOrder::kZOrder) {
+        key = get_morton_index(col, row);
+      } else {
+        // Block by block, so that all patches starting in the same block are
+        // read back to back while that block is still cached. When the
+        // blocks are not larger than the stride this is plain raster order.
+        key = static_cast<uint64_t>(patch.y / block_height) << 32 |
+              static_cast<uint64_t>(patch.x / block_width);
+      }
+      patches.emplace_back(key, patch);
+    }
+  }
+  std::stable_sort(
+      patches.begin(), patches.end(),
+      [](const std::pair<uint64_t, cv::Rect>& a,
+         const std::pair<uint64_t, cv::Rect>& b) { return a.first < b.first; });
+
+  std::vector<cv::Rect> coordinates;
+  coordinates.reserve(patches.size());
+  for (const auto& patch : patches) {
+    coordinates.push_back(patch.second);
+  }
+  return coordinates;
+}
+
+std::vector<cv::Rect>
+GdalImageLoader::get_coarse_coordinates(int factor, const cv::Rect& aoi) const
 {
   std::vector<cv::Rect> coordinates;
   int image_width = dataset_->GetRasterXSize();
   int image_height = dataset_->GetRasterYSize();
+  int window_width = std::min(patch_size_ * factor, image_width);
+  int window_height = std::min(patch_size_ * factor, image_height);
 
-  // Calculate the coordinates of each patch
-  for (int y = 0; y < image_height; y += stride_size_) {
-    for (int x = 0; x < image_width; x += stride_size_) {
-      int calib_x = std::min(x, image_width - patch_size_);
-      int calib_y = std::min(y, image_height - patch_size_);
-      coordinates.push_back(
-          cv::Rect(calib_x, calib_y, patch_size_, patch_size_));
+  for (int y : get_patch_origins(image_height, window_height, window_height)) {
+    for (int x : get_patch_origins(image_width, window_width, window_width)) {
+      cv::Rect window(x, y, window_width, window_height);
+      if (aoi.empty() || !(window & aoi).empty()) {
+        coordinates.push_back(window);
+      }
     }
   }
 
   return coordinates;
 }
 
+cv::Rect
+GdalImageLoader::get_pixel_window(const std::vector<double>& bbox) const
+{
+  if (bbox.size() != 4) {
+    throw std::runtime_error("Bounding box must have 4 values.");
+  }
+
+  double geotransform[6];
+  double inverse[6];
+  if (!get_geotransform(geotransform) ||
+      !GDALInvGeoTransform(geotransform, inverse)) {
+    throw std::runtime_error("Image has no usable geotransform.");
+  }
+
+  // Project all four corners, so rotated geotransforms are covered too
+  double min_x = std::numeric_limits<double>::max();
+  double min_y = std::numeric_limits<double>::max();
+  double max_x = std::numeric_limits<double>::lowest();
+  double max_y = std::numeric_limits<double>::lowest();
+  for (double geo_x : {bbox[0], bbox[2]}) {
+    for (double geo_y : {bbox[1], bbox[3]}) {
+      double pixel_x, pixel_y;
+      GDALApplyGeoTransform(inverse, geo_x, geo_y, &pixel_x, &pixel_y);
+      min_x = std::min(min_x, pixel_x);
+      min_y = std::min(min_y, pixel_y);
+      max_x = std::max(max_x, pixel_x);
+      max_y = std::max(max_y, pixel_y);
+    }
+  }
+
+  cv::Rect window(
+      static_cast<int>(std::floor(min_x)), static_cast<int>(std::floor(min_y)),
+      static_cast<int>(std::ceil(max_x) - std::floor(min_x)),
+      static_cast<int>(std::ceil(max_y) - std::floor(min_y)));
+  return window & cv::Rect(0, 0, get_image_width(), get_image_height());
+}
+
+bool
+GdalImageLoader::get_geotransform(double* geotransform) const
+{
+  return dataset_->GetGeoTransform(geotransform) == CE_None;
+}
+
+std::string
+GdalImageLoader::get_projection() const
+{
+  const char* projection = dataset_->GetProjectionRef();
+  return projection ? projection : "";
+}
+
 ImagePatch
 GdalImageLoader::read_patch_from_coordinates(const cv::Rect& coords) const
 {
-  try {
-    cv::Mat patch(coords.height, coords.width, CV_8UC3);  // 3 channels (RGB)
+  if (is_memory_mapped()) {
+    return read_patch_from_memory_map(coords);
+  }
+  return read_patch_from_coordinates(coords, coords.size());
+}
 
-    // Read the RGB channels
-    red_band_->RasterIO(
-        GF_Read, coords.x, coords.y, coords.width, coords.height, patch.data,
-        coords.width, coords.height, GDT_Byte, 3, patch.step);
-    green_band_->RasterIO(
-        GF_Read, coords.x, coords.y, coords.width, coords.height,
-        patch.data + 1, coords.width, coords.height, GDT_Byte, 3, patch.step);
-    blue_band_->RasterIO(
-        GF_Read, coords.x, coords.y, coords.width, coords.height,
-        patch.data + 2, coords.width, coords.height, GDT_Byte, 3, patch.step);
+ImagePatch
+GdalImageLoader::read_patch_from_coordinates(
+    const cv::Rect& coords, const cv::Size& buffer_size) const
+{
+  // 3 channels (RGB)
+  return read_patch_into(
+      coords, cv::Mat(buffer_size.height, buffer_size.width, CV_8UC3));
+}
 
-    return {patch, coords};  // Return the patch and its coordinates
+ImagePatch
+GdalImageLoader::read_patch_into(const cv::Rect& coords, cv::Mat patch) const
+{
+  if (patch.type() != CV_8UC3 || !patch.isContinuous()) {
+    throw std::runtime_error("Patch buffer must be continuous CV_8UC3.");
   }
-  catch (const std::exception& e) {
-    throw std::runtime_error("Error reading patch: " + std::string(e.what()));
+  if (needs_band_stretch()) {
+    return read_stretched_patch(coords, patch);
   }
+  cv::Size buffer_size = patch.size();
+
+  // Average when downsampling, so GDAL reads from the nearest overview
+  GDALRasterIOExtraArg extra_arg;
+  INIT_RASTERIO_EXTRA_ARG(extra_arg);
+  if (buffer_size != coords.size()) {
+    extra_arg.eResampleAlg = GRIORA_Average;
+  }
+
+  // Read all channels with a single pixel-interleaved dataset-level read, so
+  // each source block is decoded once per patch instead of once per band
+  CPLErr err = dataset_->RasterIO(
+      GF_Read, coords.x, coords.y, coords.width, coords.height, patch.data,
+      buffer_size.width, buffer_size.height, GDT_Byte,
+      static_cast<int>(band_map_.size()), const_cast<int*>(band_map_.data()),
+      band_map_.size(), patch.step, 1, &extra_arg);
+  if (err != CE_None) {
+    throw std::runtime_error(
+        "Error reading patch: " + std::string(CPLGetLastErrorMsg()));
+  }
+
+  return {patch, coords};  // Return the patch and its coordinates
+}
+
+ImagePatch
+GdalImageLoader::read_stretched_patch(
+    const cv::Rect& coords, cv::Mat patch) const
+{
+  if (!band_stretch_) {
+    throw std::runtime_error("Band stretch is not initialized.");
+  }
+
+  // Unsigned 16-bit samples are read as is, anything else as Float32
+  GDALDataType read_type =
+      source_type_ == GDT_UInt16 ? GDT_UInt16 : GDT_Float32;
+  cv::Size buffer_size = patch.size();
+  int sample_size = GDALGetDataTypeSizeBytes(read_type);
+  int band_count = static_cast<int>(band_map_.size());
+  size_t pixel_count = static_cast<size_t>(buffer_size.area());
+  sample_buffer_.resize(pixel_count * band_count * sample_size);
+
+  GDALRasterIOExtraArg extra_arg;
+  INIT_RASTERIO_EXTRA_ARG(extra_arg);
+  if (buffer_size != coords.size()) {
+    extra_arg.eResampleAlg = GRIORA_Average;
+  }
+
+  CPLErr err = dataset_->RasterIO(
+      GF_Read, coords.x, coords.y, coords.width, coords.height,
+      sample_buffer_.data(), buffer_size.width, buffer_size.height, read_type,
+      band_count, const_cast<int*>(band_map_.data()), band_count * sample_size,
+      static_cast<GSpacing>(buffer_size.width) * band_count * sample_size,
+      sample_size, &extra_arg);
+  if (err != CE_None) {
+    throw std::runtime_error(
+        "Error reading patch: " + std::string(CPLGetLastErrorMsg()));
+  }
+
+  if (read_type == GDT_UInt16) {
+    band_stretch_->apply(
+        reinterpret_cast<const uint16_t*>(sample_buffer_.data()), patch.data,
+        pixel_count);
+  } else {
+    band_stretch_->apply(
+        reinterpret_cast<const float*>(sample_buffer_.data()), patch.data,
+        pixel_count);
+  }
+
+  return {patch, coords};
+}
+
+bool
+GdalImageLoader::is_patch_unwritten(const cv::Rect& coords) const
+{
+  for (int band_index : band_map_) {
+    int status = dataset_->GetRasterBand(band_index)->GetDataCoverageStatus(
+        coords.x, coords.y, coords.width, coords.height);
+    if (status != GDAL_DATA_COVERAGE_STATUS_EMPTY) {
+      return false;
+    }
+  }
+  return true;
+}
+
+PatchContent
+GdalImageLoader::classify_patch(const ImagePatch& patch) const
+{
+  const cv::Mat& image = patch.image;
+  size_t row_bytes = image.cols * image.elemSize();
+
+  // A patch is uniform when its first row repeats the first pixel and every
+  // other row repeats the first row
+  bool is_uniform = true;
+  const uint8_t* first_row = image.ptr<uint8_t>(0);
+  for (int x = 1; x < image.cols && is_uniform; ++x) {
+    is_uniform = std::memcmp(
+                     first_row, first_row + x * image.elemSize(),
+                     image.elemSize()) == 0;
+  }
+  for (int y = 1; y < image.rows && is_uniform; ++y) {
+    is_uniform = std::memcmp(first_row, image.ptr<uint8_t>(y), row_bytes) == 0;
+  }
+
+  if (is_uniform) {
+    // Uniform patches holding the nodata value of every band are empty
+    for (size_t c = 0; c < band_map_.size(); ++c) {
+      int has_nodata = 0;
+      double nodata =
+          dataset_->GetRasterBand(band_map_[c])->GetNoDataValue(&has_nodata);
+      if (!has_nodata || nodata != first_row[c]) {
+        return PatchContent::kUniform;
+      }
+    }
+    return PatchContent::kEmpty;
+  }
+
+  // Otherwise the patch can only be empty through a dataset mask or an alpha
+  // band, which may hide arbitrary pixel values
+  GDALRasterBand* band = dataset_->GetRasterBand(band_map_[0]);
+  int mask_flags = band->GetMaskFlags();
+  if ((mask_flags & GMF_ALL_VALID) || (mask_flags & GMF_NODATA)) {
+    return PatchContent::kData;
+  }
+
+  const cv::Rect& roi = patch.roi;
+  cv::Mat mask(roi.height, roi.width, CV_8UC1);
+  CPLErr err = band->GetMaskBand()->RasterIO(
+      GF_Read, roi.x, roi.y, roi.width, roi.height, mask.data, roi.width,
+      roi.height, GDT_Byte, 1, mask.step);
+  if (err != CE_None) {
+    return PatchContent::kData;
+  }
+  for (int y = 0; y < mask.rows; ++y) {
+    const uint8_t* row = mask.ptr<uint8_t>(y);
+    if (std::any_of(row, row + mask.cols, [](uint8_t v) { return v != 0; })) {
+      return PatchContent::kData;
+    }
+  }
+  return PatchContent::kEmpty;
 }
 
 int
@@ -95,9 +457,149 @@ GdalImageLoader::get_image_height() const
   return dataset_->GetRasterYSize();
 }
 
+bool
+GdalImageLoader::is_memory_mapped() const
+{
+  return !band_mappings_.empty();
+}
+
+bool
+GdalImageLoader::needs_band_stretch() const
+{
+  return source_type_ != GDT_Byte;
+}
+
+void
+GdalImageLoader::init_band_stretch(double percentile)
+{
+  if (needs_band_stretch()) {
+    band_stretch_ = std::make_shared<const BandStretch>(
+        BandStretch::from_dataset(dataset_, band_map_, percentile));
+  }
+}
+
+std::shared_ptr<const BandStretch>
+GdalImageLoader::get_band_stretch() const
+{
+  return band_stretch_;
+}
+
+void
+GdalImageLoader::set_band_stretch(
+    std::shared_ptr<const BandStretch> band_stretch)
+{
+  band_stretch_ = std::move(band_stretch);
+}
+
+bool
+GdalImageLoader::init_memory_map()
+{
+  if (!CPLIsVirtualMemFileMapAvailable()) {
+    return false;
+  }
+
+  // Only accept real file mappings (uncompressed stripped GTiffs, raw formats
+  // such as ENVI), not GDAL's page-fault emulation over RasterIO
+  CPLStringList options;
+  options.SetNameValue("USE_DEFAULT_IMPLEMENTATION", "NO");
+
+  for (int band_index : band_map_) {
+    GDALRasterBand* band = dataset_->GetRasterBand(band_index);
+    if (band->GetRasterDataType() != GDT_Byte) {
+      return false;
+    }
+
+    int pixel_space = 0;
+    GIntBig line_space = 0;
+    CPLVirtualMem* mapping =
+        band->GetVirtualMemAuto(GF_Read, &pixel_space, &line_space, options);
+    if (!mapping) {
+      return false;
+    }
+
+    band_mappings_.push_back(mapping);
+    band_addresses_.push_back(
+        static_cast<const uint8_t*>(CPLVirtualMemGetAddr(mapping)));
+    pixel_spaces_.push_back(pixel_space);
+    line_spaces_.push_back(line_space);
+  }
+
+  // A 3-band pixel-interleaved file mapped from the first band already holds
+  // RGB triplets, so patches can be served as views without any copy
+  const char* interleave =
+      dataset_->GetMetadataItem("INTERLEAVE", "IMAGE_STRUCTURE");
+  pixel_interleaved_ = interleave && EQUAL(interleave, "PIXEL") &&
+                       dataset_->GetRasterCount() == 3 &&
+                       band_map_ == std::vector<int>{1, 2, 3} &&
+                       pixel_spaces_[0] == 3;
+
+  return true;
+}
+
+ImagePatch
+GdalImageLoader::read_patch_from_memory_map(const cv::Rect& coords) const
+{
+  const uint8_t* origin = band_addresses_[0] +
+                          coords.y * line_spaces_[0] +
+                          coords.x * pixel_spaces_[0];
+
+  // The first band's mapping ends at its own last sample, so the trailing
+  // green and blue bytes of the very last pixel may lie outside of it
+  size_t last_byte = (coords.height - 1) * line_spaces_[0] +
+                     (coords.width - 1) * pixel_spaces_[0] + 2;
+  if (pixel_interleaved_ &&
+      (origin - band_addresses_[0]) + last_byte <
+          CPLVirtualMemGetSize(band_mappings_[0])) {
+    cv::Mat view(
+        coords.height, coords.width, CV_8UC3, const_cast<uint8_t*>(origin),
+        line_spaces_[0]);
+    // Rows are a scene line apart, and the Triton client sends the patch as
+    // one contiguous block
+    return {view.isContinuous() ? view : view.clone(), coords};
+  }
+
+  // Gather the bands into an interleaved patch straight from the mappings
+  cv::Mat patch(coords.height, coords.width, CV_8UC3);
+  for (size_t c = 0; c < band_addresses_.size(); ++c) {
+    const uint8_t* band_origin = band_addresses_[c] +
+                                 coords.y * line_spaces_[c] +
+                                 coords.x * pixel_spaces_[c];
+    for (int y = 0; y < coords.height; ++y) {
+      const uint8_t* src = band_origin + y * line_spaces_[c];
+      uint8_t* dst = patch.ptr<uint8_t>(y) + c;
+      if (pixel_spaces_[c] == 1) {
+        for (int x = 0; x < coords.width; ++x) {
+          dst[x * 3] = src[x];
+        }
+      } else {
+        for (int x = 0; x < coords.width; ++x) {
+          dst[x * 3] = src[x * pixel_spaces_[c]];
+        }
+      }
+    }
+  }
+
+  return {patch, coords};
+}
+
+void
+GdalImageLoader::release_memory_map()
+{
+  for (CPLVirtualMem* mapping : band_mappings_) {
+    CPLVirtualMemFree(mapping);
+  }
+  band_mappings_.clear();
+  band_addresses_.clear();
+  pixel_spaces_.clear();
+  line_spaces_.clear();
+  pixel_interleaved_ = false;
+}
+
 void
 GdalImageLoader::clean_up()
 {
+  release_memory_map();
+
   if (dataset_) {
     GDALClose(dataset_);
     dataset_ = nullptr;
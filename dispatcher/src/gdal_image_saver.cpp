@@ -1,20 +1,131 @@
 #include "gdal_image_saver.h"
 
+#include <cpl_string.h>
 #include <gdal_priv.h>
 
-#include <boost/uuid/uuid.hpp>
-#include <boost/uuid/uuid_generators.hpp>
-#include <boost/uuid/uuid_io.hpp>
-#include <filesystem>
+#include <algorithm>
+#include <memory>
 #include <stdexcept>
 
 namespace scene {
 
-const std::string COUNT_FILENAME_PREFIX = "/tmp/.countmap_";
+// Tile edge of compressed outputs
+const int OUTPUT_TILE_SIZE = 512;
 
-GdalImageSaver::GdalImageSaver(const std::string& output_path, int num_classes)
-    : output_path_(output_path), num_classes_(num_classes),
-      is_initialized_(false), image_dataset_(nullptr), count_dataset_(nullptr)
+// Writes queued for the writer thread before producers wait for it
+const size_t MAX_PENDING_WRITES = 64;
+
+namespace {
+
+// Gets the deepest overlap along one axis of the given [start, end) spans
+int
+get_max_span_overlap(std::vector<std::pair<int, int>> spans)
+{
+  // Each distinct span is one row or column of the patch grid
+  std::sort(spans.begin(), spans.end());
+  spans.erase(std::unique(spans.begin(), spans.end()), spans.end());
+
+  std::vector<std::pair<int, int>> events;
+  for (const auto& span : spans) {
+    events.emplace_back(span.first, 1);
+    events.emplace_back(span.second, -1);
+  }
+  std::sort(events.begin(), events.end());
+
+  int depth = 0, max_depth = 0;
+  for (const auto& event : events) {
+    depth += event.second;
+    max_depth = std::max(max_depth, depth);
+  }
+  return max_depth;
+}
+
+// Bounds the number of patches voting on a single pixel, as the product of
+// the deepest horizontal and vertical overlaps of the patch grid
+int
+get_max_overlap(const std::vector<cv::Rect>& rois)
+{
+  std::vector<std::pair<int, int>> x_spans, y_spans;
+  for (const cv::Rect& roi : rois) {
+    x_spans.emplace_back(roi.x, roi.x + roi.width);
+    y_spans.emplace_back(roi.y, roi.y + roi.height);
+  }
+  return get_max_span_overlap(x_spans) * get_max_span_overlap(y_spans);
+}
+
+// Gets the bounds of the spans owned by each distinct patch span along one
+// axis, so that owned spans tile the covered extent exactly. Neighbouring
+// patches split their overlap at the midpoint between their centres, and
+// the outermost patches keep their outer borders. Owned spans may run past
+// their patches when patches do not overlap, save_center clamps them.
+void
+get_crop_bounds(
+    std::vector<std::pair<int, int>> spans, std::vector<int>& origins,
+    std::vector<int>& bounds)
+{
+  std::sort(spans.begin(), spans.end());
+  spans.erase(std::unique(spans.begin(), spans.end()), spans.end());
+
+  origins.clear();
+  bounds.clear();
+  for (size_t i = 0; i < spans.size(); ++i) {
+    origins.push_back(spans[i].first);
+    if (i == 0) {
+      bounds.push_back(spans[i].first);
+    } else {
+      int previous_centre = spans[i - 1].first + spans[i - 1].second;
+      int centre = spans[i].first + spans[i].second;
+      bounds.push_back((previous_centre + centre) / 4);
+    }
+  }
+  if (!spans.empty()) {
+    bounds.push_back(spans.back().second);
+  }
+}
+
+// Gets the span a patch starting at origin owns, from get_crop_bounds
+std::pair<int, int>
+get_crop_span(
+    int origin, const std::vector<int>& origins, const std::vector<int>& bounds)
+{
+  auto it = std::lower_bound(origins.begin(), origins.end(), origin);
+  if (it == origins.end() || *it != origin) {
+    throw std::runtime_error("Patch was not registered for center cropping.");
+  }
+  size_t index = it - origins.begin();
+  return {bounds[index], bounds[index + 1]};
+}
+
+// Gets the overview pixels, along one axis, whose nearest-neighbour sample
+// lies in [start, end) of the full-resolution extent
+cv::Range
+get_sampled_range(
+    int start, int end, int factor, int overview_extent, int extent)
+{
+  auto source_index = [factor, extent](int index) {
+    return std::min(index * factor + factor / 2, extent - 1);
+  };
+
+  int first = std::max(0, start / factor - 1);
+  while (first < overview_extent && source_index(first) < start) {
+    ++first;
+  }
+  int last = first;
+  while (last < overview_extent && source_index(last) < end) {
+    ++last;
+  }
+  return cv::Range(first, last);
+}
+
+}  // namespace
+
+GdalImageSaver::GdalImageSaver(
+    const std::string& output_path, int num_classes,
+    const std::string& compression)
+    : image_dataset_(nullptr), output_path_(output_path),
+      compression_(compression), soft_vote_scale_(0), center_crop_(false),
+      num_classes_(num_classes), has_geotransform_(false),
+      is_initialized_(false)
 {
   GDALAllRegister();
 }
@@ -27,129 +138,450 @@ GdalImageSaver::~GdalImageSaver()
 void
 GdalImageSaver::clean_up()
 {
+  // Let queued writes finish before the dataset goes away
+  writer_.reset();
+
   if (image_dataset_) {
     GDALClose(image_dataset_);
     image_dataset_ = nullptr;
   }
 
-  if (count_dataset_) {
-    GDALClose(count_dataset_);
-    count_dataset_ = nullptr;
-  }
-
-  if (!count_filename_.empty() && std::filesystem::exists(count_filename_)) {
-    std::filesystem::remove(count_filename_);
-  }
+  votes_.reset();
+  soft_votes_.reset();
 }
 
-std::string
-GdalImageSaver::generate_uuid()
+void
+GdalImageSaver::set_georeference(
+    const double* geotransform, const std::string& wkt)
 {
-  boost::uuids::uuid uuid = boost::uuids::random_generator()();
-  return boost::uuids::to_string(uuid);
+  has_geotransform_ = geotransform != nullptr;
+  if (has_geotransform_) {
+    std::copy(geotransform, geotransform + 6, geotransform_);
+  }
+  projection_ = wkt;
 }
 
 void
-GdalImageSaver::init_gdal(int width, int height)
+GdalImageSaver::init_gdal(
+    int width, int height, const cv::Rect& window, bool update_existing)
 {
   std::lock_guard<std::mutex> lock(init_mutex_);
   if (is_initialized_) {
     return;
   }
 
-  width_ = width;
-  height_ = height;
-
   if (width <= 0 || height <= 0) {
     throw std::runtime_error("Invalid image dimensions for init_gdal.");
   }
 
+  window_ = window.empty() ? cv::Rect(0, 0, width, height)
+                           : window & cv::Rect(0, 0, width, height);
+  if (window_.empty()) {
+    throw std::runtime_error("Output window lies outside of the image.");
+  }
+  width_ = window_.width;
+  height_ = window_.height;
+
   GDALDriver* driver = GetGDALDriverManager()->GetDriverByName("GTiff");
   if (!driver) {
     throw std::runtime_error("GDAL GTiff driver not found.");
   }
 
-  // Create image dataset at output_path_
-  image_dataset_ = driver->Create(
-      output_path_.c_str(), width_, height_, 1, GDT_Byte, nullptr);
-  if (!image_dataset_) {
-    throw std::runtime_error("Failed to create image dataset at output_path.");
-  }
+  if (update_existing) {
+    // Write the window in place into an output covering the whole scene
+    image_dataset_ = static_cast<GDALDataset*>(
+        GDALOpen(output_path_.c_str(), GA_Update));
+    if (!image_dataset_) {
+      throw std::runtime_error("Failed to open existing output for update.");
+    }
+    if (image_dataset_->GetRasterXSize() != width ||
+        image_dataset_->GetRasterYSize() != height) {
+      throw std::runtime_error(
+          "Existing output does not match the image dimensions.");
+    }
+    output_origin_ = window_.tl();
+    output_size_ = cv::Size(width, height);
+
+    // Overview pixels sampled from the window are rewritten with its rows
+    read_overviews();
+  } else {
+    // Tiled and compressed by GDAL's own threads when compression is set
+    CPLStringList creation_options;
+    if (!compression_.empty()) {
+      creation_options.SetNameValue("TILED", "YES");
+      creation_options.SetNameValue(
+          "BLOCKXSIZE", std::to_string(OUTPUT_TILE_SIZE).c_str());
+      creation_options.SetNameValue(
+          "BLOCKYSIZE", std::to_string(OUTPUT_TILE_SIZE).c_str());
+      creation_options.SetNameValue("COMPRESS", compression_.c_str());
+      creation_options.SetNameValue("NUM_THREADS", "ALL_CPUS");
+      creation_options.SetNameValue("BIGTIFF", "IF_SAFER");
+    }
+
+    // Create image dataset at output_path_
+    image_dataset_ = driver->Create(
+        output_path_.c_str(), width_, height_, 1, GDT_Byte, creation_options);
+    if (!image_dataset_) {
+      throw std::runtime_error(
+          "Failed to create image dataset at output_path.");
+    }
+    output_origin_ = cv::Point(0, 0);
+    output_size_ = cv::Size(width_, height_);
+
+    // Carry over the georeferencing, shifted to the window origin
+    if (has_geotransform_) {
+      double geotransform[6];
+      std::copy(geotransform_, geotransform_ + 6, geotransform);
+      geotransform[0] += window_.x * geotransform_[1] +
+                         window_.y * geotransform_[2];
+      geotransform[3] += window_.x * geotransform_[4] +
+                         window_.y * geotransform_[5];
+      image_dataset_->SetGeoTransform(geotransform);
+    }
+    if (!projection_.empty()) {
+      image_dataset_->SetProjection(projection_.c_str());
+    }
 
-  // Apply the grayscale palette to the image dataset
-  apply_palette();
+    // Apply the grayscale palette to the image dataset
+    apply_palette();
 
-  // Create count map dataset as a temporary file
-  std::string uuid = generate_uuid();
-  count_filename_ = COUNT_FILENAME_PREFIX + uuid + ".tif";
-  count_dataset_ = driver->Create(
-      count_filename_.c_str(), width_, height_, num_classes_, GDT_Int32,
-      nullptr);
-  if (!count_dataset_) {
-    throw std::runtime_error("Failed to create count map dataset.");
+    if (!compression_.empty()) {
+      create_overviews();
+    }
   }
 
+  writer_ = std::make_unique<utility::WorkerThread>();
   is_initialized_ = true;
 }
 
+void
+GdalImageSaver::set_soft_voting(int scale)
+{
+  soft_vote_scale_ = scale;
+}
+
+void
+GdalImageSaver::set_center_crop(bool center_crop)
+{
+  center_crop_ = center_crop;
+}
+
+void
+GdalImageSaver::expect_patches(const std::vector<cv::Rect>& rois)
+{
+  std::lock_guard<std::mutex> lock(init_mutex_);
+  if (!is_initialized_) {
+    throw std::runtime_error("GDAL is not initialized.");
+  }
+
+  // Center-cropped patches own disjoint regions and need no accumulator
+  if (center_crop_) {
+    std::vector<std::pair<int, int>> x_spans, y_spans;
+    for (const cv::Rect& roi : rois) {
+      x_spans.emplace_back(roi.x, roi.x + roi.width);
+      y_spans.emplace_back(roi.y, roi.y + roi.height);
+    }
+    get_crop_bounds(x_spans, crop_x_origins_, crop_x_bounds_);
+    get_crop_bounds(y_spans, crop_y_origins_, crop_y_bounds_);
+    return;
+  }
+
+  // Soft votes are weighted across the whole patch, so patches are only
+  // shifted to the window and clipped by the accumulator
+  if (soft_vote_scale_ > 0) {
+    soft_votes_ = std::make_unique<SoftVoteAccumulator>(
+        width_, height_, num_classes_, soft_vote_scale_);
+    for (const cv::Rect& roi : rois) {
+      if (!(roi & window_).empty()) {
+        soft_votes_->expect_patch(roi - window_.tl());
+      }
+    }
+    return;
+  }
+
+  std::vector<cv::Rect> clipped_rois;
+  for (const cv::Rect& roi : rois) {
+    cv::Rect clipped = roi & window_;
+    if (!clipped.empty()) {
+      clipped_rois.push_back(clipped - window_.tl());
+    }
+  }
+
+  // Keep class votes in memory, only for the tile columns of the rows still
+  // being worked on, in counters just wide enough for the deepest overlap
+  votes_ = std::make_unique<VoteAccumulator>(
+      width_, height_, num_classes_, get_max_overlap(clipped_rois),
+      OUTPUT_TILE_SIZE);
+  for (const cv::Rect& roi : clipped_rois) {
+    votes_->expect_patch(roi);
+  }
+}
+
 void
 GdalImageSaver::save_patch(const cv::Rect& roi, const cv::Mat& patch)
 {
   // Ensure GDAL is initialized
-  {
-    std::lock_guard<std::mutex> lock(init_mutex_);
-    if (!is_initialized_) {
-      throw std::runtime_error("GDAL is not initialized.");
+  if (!is_initialized_ || !(votes_ || soft_votes_ || center_crop_)) {
+    throw std::runtime_error("GDAL is not initialized.");
+  }
+
+  if (center_crop_) {
+    save_center(roi, patch);
+    return;
+  }
+
+  if (soft_votes_) {
+    if (!(roi & window_).empty()) {
+      write_final_rows(soft_votes_->add_labels(roi - window_.tl(), patch));
     }
+    return;
   }
 
-  // Prepare buffers for count map and final class labels
-  std::vector<int> count_buffer(roi.width * roi.height * num_classes_, 0);
-  std::vector<uint8_t> final_class_buffer(roi.width * roi.height, 0);
+  // Only the part of the patch inside the output window is voted
+  cv::Rect clipped = roi & window_;
+  if (clipped.empty()) {
+    return;
+  }
+  cv::Mat clipped_patch = patch(clipped - roi.tl());
 
-  // Populate count buffer and track final class labels
-  for (int y = 0; y < roi.height; ++y) {
-    for (int x = 0; x < roi.width; ++x) {
-      int local_idx = y * roi.width + x;
-      int class_label = patch.at<uint8_t>(y, x);
+  // Regions that no other patch covers anymore are written out right away
+  write_final_regions(
+      votes_->add_votes(clipped - window_.tl(), clipped_patch));
+}
 
-      if (class_label < num_classes_) {
-        count_buffer[local_idx * num_classes_ + class_label] += 1;
-      }
+void
+GdalImageSaver::save_probabilities(
+    const cv::Rect& roi, const cv::Mat& probabilities)
+{
+  if (!is_initialized_ || !soft_votes_) {
+    throw std::runtime_error("Soft voting is not initialized.");
+  }
+
+  if (!(roi & window_).empty()) {
+    write_final_rows(
+        soft_votes_->add_probabilities(roi - window_.tl(), probabilities));
+  }
+}
+
+void
+GdalImageSaver::finalize()
+{
+  if (!is_initialized_ || !(votes_ || soft_votes_ || center_crop_)) {
+    throw std::runtime_error("GDAL is not initialized.");
+  }
+
+  if (soft_votes_) {
+    write_final_rows(soft_votes_->finish());
+  } else if (votes_) {
+    write_final_regions(votes_->get_pending_regions());
+  }
+
+  // Wait for the writer, surfacing the first write error
+  std::deque<std::future<void>> writes;
+  {
+    std::lock_guard<std::mutex> lock(writes_mutex_);
+    writes.swap(pending_writes_);
+  }
+  for (auto& write : writes) {
+    collect_write(write);
+  }
+
+  std::lock_guard<std::mutex> lock(writes_mutex_);
+  if (write_error_) {
+    std::rethrow_exception(write_error_);
+  }
+}
+
+void
+GdalImageSaver::collect_write(std::future<void>& write)
+{
+  try {
+    write.get();
+  }
+  catch (...) {
+    std::lock_guard<std::mutex> lock(writes_mutex_);
+    if (!write_error_) {
+      write_error_ = std::current_exception();
     }
   }
+}
 
-  // Write count buffer and find final class labels
-  for (int c = 0; c < num_classes_; ++c) {
-    GDALRasterBand* count_band = count_dataset_->GetRasterBand(c + 1);
-    std::vector<int> single_class_buffer(roi.width * roi.height);
+void
+GdalImageSaver::save_center(const cv::Rect& roi, const cv::Mat& patch)
+{
+  std::pair<int, int> x_span =
+      get_crop_span(roi.x, crop_x_origins_, crop_x_bounds_);
+  std::pair<int, int> y_span =
+      get_crop_span(roi.y, crop_y_origins_, crop_y_bounds_);
+  cv::Rect center(
+      x_span.first, y_span.first, x_span.second - x_span.first,
+      y_span.second - y_span.first);
+
+  // With a stride above the patch size the owned span outgrows the patch,
+  // and the uncovered gap between patches stays nodata
+  cv::Rect clipped = center & cv::Rect(roi.tl(), patch.size()) & window_;
+  if (clipped.empty()) {
+    return;
+  }
 
-    for (int i = 0; i < roi.width * roi.height; ++i) {
-      single_class_buffer[i] = count_buffer[i * num_classes_ + c];
+  // Label bytes go straight to the output, owned regions never overlap
+  cv::Rect source = clipped - roi.tl();
+  utility::BufferPool::Buffer labels =
+      label_buffers_.acquire(static_cast<size_t>(clipped.area()));
+  for (int y = 0; y < source.height; ++y) {
+    const uint8_t* row = patch.ptr<uint8_t>(source.y + y) + source.x;
+    std::copy(
+        row, row + source.width,
+        labels->data() + static_cast<size_t>(y) * source.width);
+  }
+  queue_write(clipped - window_.tl(), labels);
+}
 
-      // Determine final class for each pixel based on max count
-      if (single_class_buffer[i] >
-          count_buffer[i * num_classes_ + final_class_buffer[i]]) {
-        final_class_buffer[i] = static_cast<uint8_t>(c);
-      }
+void
+GdalImageSaver::write_final_rows(const std::vector<cv::Range>& row_ranges)
+{
+  for (const cv::Range& rows : row_ranges) {
+    // The argmax runs on the calling worker, only the write is serialised
+    utility::BufferPool::Buffer final_class_buffer =
+        label_buffers_.acquire(static_cast<size_t>(rows.size()) * width_);
+    soft_votes_->take_labels(rows, final_class_buffer->data());
+    queue_write(
+        cv::Rect(0, rows.start, width_, rows.size()), final_class_buffer);
+  }
+}
+
+void
+GdalImageSaver::write_final_regions(const std::vector<cv::Rect>& regions)
+{
+  for (const cv::Rect& region : regions) {
+    // The argmax runs on the calling worker, only the write is serialised
+    utility::BufferPool::Buffer final_class_buffer =
+        label_buffers_.acquire(static_cast<size_t>(region.area()));
+    votes_->take_labels(region, final_class_buffer->data());
+    queue_write(region, final_class_buffer);
+  }
+}
+
+void
+GdalImageSaver::queue_write(
+    const cv::Rect& region, utility::BufferPool::Buffer labels)
+{
+  // Write final class labels to the image dataset on the writer thread
+  std::future<void> write = writer_->add_task([this, region, labels]() {
+    GDALRasterBand* image_band = image_dataset_->GetRasterBand(1);
+    CPLErr err = image_band->RasterIO(
+        GF_Write, output_origin_.x + region.x, output_origin_.y + region.y,
+        region.width, region.height, labels->data(), region.width,
+        region.height, GDT_Byte, 0, 0);
+    if (err != CE_None) {
+      throw std::runtime_error(
+          "Failed to write labels: " + std::string(CPLGetLastErrorMsg()));
     }
+    write_overview_region(region, labels->data());
+  });
+
+  // Hold the producer back while the writer is behind, so final labels do
+  // not pile up in memory faster than the disk takes them
+  std::unique_lock<std::mutex> lock(writes_mutex_);
+  while (pending_writes_.size() >= MAX_PENDING_WRITES) {
+    std::future<void> oldest = std::move(pending_writes_.front());
+    pending_writes_.pop_front();
+    lock.unlock();
+    collect_write(oldest);
+    lock.lock();
+  }
+  pending_writes_.push_back(std::move(write));
+}
+
+void
+GdalImageSaver::create_overviews()
+{
+  overview_factors_.clear();
+  for (int factor = 2; std::max(width_, height_) / factor >= OUTPUT_TILE_SIZE;
+       factor *= 2) {
+    overview_factors_.push_back(factor);
+  }
+  if (overview_factors_.empty()) {
+    return;
+  }
 
-    // Write count map to disk
-    {
-      std::lock_guard<std::mutex> lock(init_mutex_);
-      count_band->RasterIO(
-          GF_Write, roi.x, roi.y, roi.width, roi.height,
-          single_class_buffer.data(), roi.width, roi.height, GDT_Int32, 0, 0);
+  // "NONE" only lays out the overview levels, their pixels are written as
+  // the full-resolution rows become final
+  CPLErr err = image_dataset_->BuildOverviews(
+      "NONE", overview_factors_.size(), overview_factors_.data(), 0, nullptr,
+      nullptr, nullptr);
+  if (err != CE_None) {
+    throw std::runtime_error(
+        "Failed to create overviews: " + std::string(CPLGetLastErrorMsg()));
+  }
+}
+
+void
+GdalImageSaver::read_overviews()
+{
+  overview_factors_.clear();
+  GDALRasterBand* image_band = image_dataset_->GetRasterBand(1);
+  for (int level = 0; level < image_band->GetOverviewCount(); ++level) {
+    GDALRasterBand* overview = image_band->GetOverview(level);
+    if (!overview) {
+      throw std::runtime_error(
+          "Failed to read overviews: " + std::string(CPLGetLastErrorMsg()));
     }
+    overview_factors_.push_back(GDALComputeOvFactor(
+        overview->GetXSize(), output_size_.width, overview->GetYSize(),
+        output_size_.height));
   }
+}
 
-  // Write final class labels directly to the image dataset
+void
+GdalImageSaver::write_overview_region(
+    const cv::Rect& region, const uint8_t* labels)
+{
   GDALRasterBand* image_band = image_dataset_->GetRasterBand(1);
-  {
-    std::lock_guard<std::mutex> lock(init_mutex_);
-    image_band->RasterIO(
-        GF_Write, roi.x, roi.y, roi.width, roi.height,
-        final_class_buffer.data(), roi.width, roi.height, GDT_Byte, 0, 0);
+
+  // Overviews cover the whole output, which may extend past the window
+  cv::Rect target_region = region + output_origin_;
+  for (size_t level = 0; level < overview_factors_.size(); ++level) {
+    int factor = overview_factors_[level];
+    GDALRasterBand* overview = image_band->GetOverview(level);
+    if (!overview) {
+      continue;
+    }
+
+    // Class labels are sampled at the centre of each overview pixel, the
+    // nearest-neighbour rule for categorical data
+    cv::Range rows = get_sampled_range(
+        target_region.y, target_region.y + target_region.height, factor,
+        overview->GetYSize(), output_size_.height);
+    cv::Range cols = get_sampled_range(
+        target_region.x, target_region.x + target_region.width, factor,
+        overview->GetXSize(), output_size_.width);
+    if (rows.empty() || cols.empty()) {
+      continue;
+    }
+
+    overview_buffer_.resize(static_cast<size_t>(rows.size()) * cols.size());
+    uint8_t* target = overview_buffer_.data();
+    for (int r = rows.start; r < rows.end; ++r) {
+      int source_row =
+          std::min(r * factor + factor / 2, output_size_.height - 1);
+      const uint8_t* row_labels =
+          labels +
+          static_cast<size_t>(source_row - target_region.y) * region.width;
+      for (int c = cols.start; c < cols.end; ++c) {
+        int source_col =
+            std::min(c * factor + factor / 2, output_size_.width - 1);
+        *target++ = row_labels[source_col - target_region.x];
+      }
+    }
+
+    CPLErr err = overview->RasterIO(
+        GF_Write, cols.start, rows.start, cols.size(), rows.size(),
+        overview_buffer_.data(), cols.size(), rows.size(), GDT_Byte, 0, 0);
+    if (err != CE_None) {
+      throw std::runtime_error(
+          "Failed to write overview: " + std::string(CPLGetLastErrorMsg()));
+    }
   }
 }
 
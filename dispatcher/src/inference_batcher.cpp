@@ -0,0 +1,193 @@
+#include "inference_batcher.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace client {
+
+namespace {
+
+// Whether two queued images can share a batch
+bool
+is_batchable(
+    const cv::Mat& a, bool a_probabilities, const cv::Mat& b,
+    bool b_probabilities)
+{
+  return a.rows == b.rows && a.cols == b.cols &&
+         a_probabilities == b_probabilities;
+}
+
+}  // namespace
+
+InferenceBatcher::InferenceBatcher(
+    const std::string& model_name, const std::string& model_version,
+    const std::string& server_url, bool verbose, int batch_size,
+    int linger_us, int max_in_flight, Protocol protocol,
+    const RoutingOptions& routing, const TransportOptions& transport)
+    : batch_size_(std::max(1, batch_size)), linger_(linger_us),
+      want_stop_(false),
+      client_(std::make_unique<TritonClient>(
+          model_name, model_version, server_url, verbose, protocol))
+{
+  client_->set_max_in_flight(max_in_flight);
+  client_->set_routing(routing);
+  client_->set_transport(transport);
+  sender_ = std::thread([this]() { sender_loop(); });
+}
+
+InferenceBatcher::~InferenceBatcher()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    want_stop_ = true;
+  }
+  monitor_.notify_all();
+  if (sender_.joinable()) {
+    sender_.join();
+  }
+}
+
+std::future<cv::Mat>
+InferenceBatcher::request_inference(const cv::Mat& image)
+{
+  return submit_for_future(image, false);
+}
+
+std::future<cv::Mat>
+InferenceBatcher::request_probabilities(const cv::Mat& image)
+{
+  return submit_for_future(image, true);
+}
+
+std::future<cv::Mat>
+InferenceBatcher::submit_for_future(const cv::Mat& image, bool probabilities)
+{
+  auto promise = std::make_shared<std::promise<cv::Mat>>();
+  std::future<cv::Mat> future = promise->get_future();
+  submit(
+      image, probabilities,
+      [promise, probabilities](cv::Mat result, std::exception_ptr error) {
+        if (error) {
+          promise->set_exception(error);
+        } else {
+          // Masks view the response, which does not outlive the completion
+          promise->set_value(probabilities ? result : result.clone());
+        }
+      });
+  return future;
+}
+
+void
+InferenceBatcher::submit(
+    const cv::Mat& image, bool probabilities, Completion done)
+{
+  if (image.empty()) {
+    throw std::runtime_error("Error: Image is empty");
+  }
+
+  PendingImage pending;
+  pending.image = image;
+  pending.probabilities = probabilities;
+  pending.done = std::move(done);
+  pending.queued_at = std::chrono::steady_clock::now();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (want_stop_) {
+      throw std::runtime_error("Batcher has stopped, cannot queue images");
+    }
+    queue_.push_back(std::move(pending));
+  }
+  monitor_.notify_one();
+}
+
+void
+InferenceBatcher::set_latency_listener(TritonClient::LatencyListener listener)
+{
+  client_->set_latency_listener(std::move(listener));
+}
+
+bool
+InferenceBatcher::take_batch(std::vector<PendingImage>& batch)
+{
+  batch.clear();
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  while (true) {
+    monitor_.wait(lock, [this] { return want_stop_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return false;  // Stopped with nothing left to send
+    }
+
+    // The oldest image decides which batch goes next
+    const PendingImage& oldest = queue_.front();
+    int batchable = 0;
+    for (const PendingImage& pending : queue_) {
+      if (is_batchable(
+              oldest.image, oldest.probabilities, pending.image,
+              pending.probabilities)) {
+        batchable++;
+      }
+    }
+
+    auto due_at = oldest.queued_at + linger_;
+    if (batchable >= batch_size_ || want_stop_ ||
+        std::chrono::steady_clock::now() >= due_at) {
+      break;
+    }
+    monitor_.wait_until(lock, due_at);
+  }
+
+  // Move up to batch_size_ images batchable with the oldest, in queue order
+  cv::Mat image = queue_.front().image;
+  bool probabilities = queue_.front().probabilities;
+  for (auto it = queue_.begin();
+       it != queue_.end() && static_cast<int>(batch.size()) < batch_size_;) {
+    if (is_batchable(image, probabilities, it->image, it->probabilities)) {
+      batch.push_back(std::move(*it));
+      it = queue_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  // Let another sender look at what is left
+  if (!queue_.empty()) {
+    monitor_.notify_one();
+  }
+  return true;
+}
+
+void
+InferenceBatcher::sender_loop()
+{
+  std::vector<PendingImage> batch;
+  while (take_batch(batch)) {
+    std::vector<cv::Mat> images;
+    auto completions = std::make_shared<std::vector<Completion>>();
+    for (PendingImage& pending : batch) {
+      images.push_back(pending.image);
+      completions->push_back(std::move(pending.done));
+    }
+
+    // Blocks while the in-flight window is full, which also holds back
+    // batching so that late patches still join the next batch
+    auto done = [completions](
+                    std::vector<cv::Mat> results, std::exception_ptr error) {
+      if (!error && results.size() != completions->size()) {
+        error = std::make_exception_ptr(
+            std::runtime_error("Batch result count does not match."));
+      }
+      for (size_t i = 0; i < completions->size(); ++i) {
+        (*completions)[i](error ? cv::Mat() : results[i], error);
+      }
+    };
+    if (batch.front().probabilities) {
+      client_->request_probabilities_async(images, done);
+    } else {
+      client_->request_inference_async(images, done);
+    }
+  }
+}
+
+}  // namespace client
@@ -1,6 +1,7 @@
 #include <getopt.h>
 
 #include <iostream>
+#include <sstream>
 #include <string>
 
 #include "service.h"
@@ -13,15 +14,18 @@ main(int argc, char** argv)
   std::string url("localhost:8000");
   int patch_size = 512;
   int stride_size = 256;
-  int scaling_factor = 6;
+  int num_classes = 3;
   bool verbose = true;
+  inference::InferenceOptions options;
 
   int opt;
   // Use getopt to parse command-line arguments
-  while ((opt = getopt(argc, argv, "u:p:s:n:v")) != -1) {
+  while ((opt = getopt(
+              argc, argv,
+              "u:p:s:n:N:vme:c:b:t:z:w:B:L:i:C:O:P:S:R:H:T:Z:kM:D:")) != -1) {
     switch (opt) {
       case 'u':
-        url = optarg;  // Triton server URL
+        url = optarg;  // Triton server URLs, comma-separated
         break;
       case 'p':
         patch_size = std::stoi(optarg);  // patch_size
@@ -30,11 +34,115 @@ main(int argc, char** argv)
         stride_size = std::stoi(optarg);  // stride_size
         break;
       case 'n':
-        scaling_factor = std::stoi(optarg);  // scaling_factor
+        // The scaling factor is gone, jobs spread over every scheduler thread
+        std::cerr << "Option -n was removed, -N sets the class count"
+                  << std::endl;
+        return -1;
+      case 'N':
+        num_classes = std::stoi(optarg);  // classes the model segments into
         break;
       case 'v':
         verbose = true;  // verbose flag
         break;
+      case 'm':
+        options.memory_map = true;  // memory-mapped input
+        break;
+      case 'e':
+        options.skip_empty_patches = true;  // skip empty/uniform patches
+        options.empty_class = std::stoi(optarg);  // class to fill them with
+        break;
+      case 'c':
+        options.coarse_factor = std::stoi(optarg);  // coarse-to-fine factor
+        break;
+      case 'b': {
+        // Comma-separated source bands, e.g. 4,3,2
+        options.bands.clear();
+        std::stringstream band_list(optarg);
+        std::string band;
+        while (std::getline(band_list, band, ',')) {
+          options.bands.push_back(std::stoi(band));
+        }
+        break;
+      }
+      case 't':
+        options.stretch_percentile = std::stod(optarg);  // stretch clipping
+        break;
+      case 'z':
+        options.output_compression = optarg;  // e.g. DEFLATE, ZSTD, LZW
+        break;
+      case 'B':
+        options.batch_size = std::stoi(optarg);  // patches per request
+        break;
+      case 'L':
+        options.batch_linger_us = std::stoi(optarg);  // batch wait, in us
+        break;
+      case 'i':
+        options.max_in_flight = std::stoi(optarg);  // async requests/worker
+        break;
+      case 'C':
+        // Ceiling of the requests in flight, past the hardware threads only
+        // with -i
+        options.max_concurrency = std::stoi(optarg);
+        break;
+      case 'O': {
+        // Patch order, optionally followed by the patches taken at a time,
+        // e.g. hilbert or band,8
+        std::string order(optarg);
+        size_t comma = order.find(',');
+        options.patch_order = scene::parse_patch_order(order.substr(0, comma));
+        if (comma != std::string::npos) {
+          options.patch_chunk_size = std::stoi(order.substr(comma + 1));
+        }
+        break;
+      }
+      case 'P':
+        options.protocol = client::parse_protocol(optarg);  // http or grpc
+        break;
+      case 'R':
+        options.routing.balancing = client::parse_balancing(optarg);
+        break;
+      case 'H':
+        options.routing.hedge_percentile = std::stod(optarg);  // e.g. 95
+        break;
+      case 'T':
+        options.routing.attempt_timeout_ms = std::stoi(optarg);  // 0: none
+        break;
+      case 'Z': {
+        // Request compression, optionally followed by response compression,
+        // e.g. gzip or none,gzip
+        std::string compression(optarg);
+        size_t comma = compression.find(',');
+        options.request_compression =
+            client::parse_compression(compression.substr(0, comma));
+        options.response_compression =
+            comma == std::string::npos
+                ? options.request_compression
+                : client::parse_compression(compression.substr(comma + 1));
+        break;
+      }
+      case 'k':
+        options.pack_masks = true;  // bit-packed masks
+        break;
+      case 'M':
+        options.cache_memory_mb = std::stoi(optarg);  // result cache, e.g. 512
+        break;
+      case 'D': {
+        // Result cache directory, optionally followed by its bound in MB,
+        // e.g. /tmp/result-cache,1024
+        std::string directory(optarg);
+        size_t comma = directory.find(',');
+        options.cache_directory = directory.substr(0, comma);
+        if (comma != std::string::npos) {
+          options.cache_disk_mb = std::stoi(directory.substr(comma + 1));
+        }
+        break;
+      }
+      case 'S':
+        options.shared_memory_regions = std::stoi(optarg);  // local Triton
+        break;
+      case 'w':
+        options.soft_vote_scale = std::stoi(optarg);  // soft voting, e.g. 4
+        break;
       default:
         std::cerr << "Unknown option: " << opt << std::endl;
         return -1;
@@ -44,13 +152,90 @@ main(int argc, char** argv)
     std::cout << "Triton server URL: " << url << std::endl;
     std::cout << "Patch size: " << patch_size << std::endl;
     std::cout << "Stride size: " << stride_size << std::endl;
-    std::cout << "Scale factor: " << scaling_factor << std::endl;
+    std::cout << "Classes: " << num_classes << std::endl;
     std::cout << "Verbose: " << (verbose ? "true" : "false") << std::endl;
+    std::cout << "Protocol: "
+              << (options.protocol == client::Protocol::kGrpc ? "grpc"
+                                                               : "http")
+              << std::endl;
+    std::cout << "Memory-mapped input: "
+              << (options.memory_map ? "true" : "false") << std::endl;
+    if (options.skip_empty_patches) {
+      std::cout << "Empty patch class: " << options.empty_class << std::endl;
+    }
+    std::cout << "Bands:";
+    for (int band : options.bands) {
+      std::cout << " " << band;
+    }
+    std::cout << std::endl;
+    std::cout << "Stretch percentile: " << options.stretch_percentile
+              << std::endl;
+    if (!options.output_compression.empty()) {
+      std::cout << "Output compression: " << options.output_compression
+                << std::endl;
+    }
+    std::cout << "Patch order: "
+              << (options.patch_order == scene::PatchOrder::kHilbert
+                      ? "hilbert"
+                      : options.patch_order == scene::PatchOrder::kZOrder
+                            ? "zorder"
+                            : "band");
+    if (options.patch_chunk_size > 0) {
+      std::cout << ", " << options.patch_chunk_size << " patches at a time";
+    }
+    std::cout << std::endl;
+    if (options.coarse_factor > 1) {
+      std::cout << "Coarse factor: " << options.coarse_factor << std::endl;
+    }
+    if (options.batch_size > 1) {
+      std::cout << "Batch size: " << options.batch_size
+                << ", linger: " << options.batch_linger_us << " us"
+                << std::endl;
+    }
+    std::cout << "Balancing: "
+              << (options.routing.balancing == client::Balancing::kLatency
+                      ? "latency"
+                      : "least")
+              << std::endl;
+    std::cout << "Compression: "
+              << client::get_compression_name(options.request_compression)
+              << " requests, "
+              << client::get_compression_name(options.response_compression)
+              << " responses" << std::endl;
+    std::cout << "Packed masks: " << (options.pack_masks ? "true" : "false")
+              << std::endl;
+    std::cout << "Attempt timeout: " << options.routing.attempt_timeout_ms
+              << " ms" << std::endl;
+    if (options.routing.hedge_percentile > 0) {
+      std::cout << "Hedge percentile: " << options.routing.hedge_percentile
+                << std::endl;
+    }
+    if (options.shared_memory_regions > 0) {
+      std::cout << "Shared memory regions: " << options.shared_memory_regions
+                << std::endl;
+    }
+    if (options.cache_memory_mb > 0) {
+      std::cout << "Result cache: " << options.cache_memory_mb << " MB";
+      if (!options.cache_directory.empty()) {
+        std::cout << ", " << options.cache_disk_mb << " MB in "
+                  << options.cache_directory;
+      }
+      std::cout << std::endl;
+    }
+    std::cout << "Max concurrency: " << options.max_concurrency << std::endl;
+    if (options.max_in_flight > 0) {
+      std::cout << "Max in-flight requests: " << options.max_in_flight
+                << std::endl;
+    }
+    if (options.soft_vote_scale > 0) {
+      std::cout << "Soft vote scale: " << options.soft_vote_scale << std::endl;
+    }
   }
 
   // Initialize the service with Triton server URL
   service::InferenceService inference_service(
-      url, patch_size, stride_size, scaling_factor, verbose);
+      url, patch_size, stride_size, verbose, num_classes, "Segmenter", "", 8,
+      options);
 
   // Start the service on the specified port
   inference_service.start(SERVICE_PORT);
@@ -0,0 +1,57 @@
+#include "metrics.h"
+
+#include <sstream>
+
+namespace utility {
+
+Metrics&
+Metrics::get()
+{
+  static Metrics metrics;
+  return metrics;
+}
+
+void
+Metrics::add(const std::string& series, const std::string& help, double delta)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  get_family(series, help, "counter").series[series] += delta;
+}
+
+void
+Metrics::set(const std::string& series, const std::string& help, double value)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  get_family(series, help, "gauge").series[series] = value;
+}
+
+std::string
+Metrics::render() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ostringstream text;
+  text.precision(15);  // Byte counters stay exact
+  for (const auto& family : families_) {
+    text << "# HELP " << family.first << " " << family.second.help << "\n";
+    text << "# TYPE " << family.first << " " << family.second.type << "\n";
+    for (const auto& series : family.second.series) {
+      text << series.first << " " << series.second << "\n";
+    }
+  }
+  return text.str();
+}
+
+Metrics::Family&
+Metrics::get_family(
+    const std::string& series, const std::string& help,
+    const std::string& type)
+{
+  Family& family = families_[series.substr(0, series.find('{'))];
+  if (family.type.empty()) {
+    family.help = help;
+    family.type = type;
+  }
+  return family;
+}
+
+}  // namespace utility
@@ -0,0 +1,383 @@
+#include "result_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+#include "metrics.h"
+
+namespace fs = std::filesystem;
+
+namespace client {
+
+namespace {
+
+const char* const REQUESTS_METRIC = "dispatcher_cache_requests_total";
+const char* const REQUESTS_HELP = "Patch result cache lookups by outcome.";
+const char* const MEMORY_BYTES_METRIC = "dispatcher_cache_memory_bytes";
+const char* const DISK_BYTES_METRIC = "dispatcher_cache_disk_bytes";
+const char* const BYTES_HELP = "Bytes of masks held by the result cache.";
+const char* const SKIPPED_METRIC = "dispatcher_cache_disk_skipped_total";
+const char* const SKIPPED_HELP =
+    "Result cache disk writes and touches dropped while the disk was behind.";
+
+// Size of the rows and columns header of a mask file
+const size_t HEADER_SIZE = 2 * sizeof(int32_t);
+
+// Writes between scans for the files of other processes, and the age past
+// which a file left half-written by any process is removed
+const int SCAN_INTERVAL_WRITES = 64;
+const auto STALE_TEMPORARY_AGE = std::chrono::minutes(10);
+
+// Disk tasks queued before further ones are dropped, each holding a mask
+const int MAX_PENDING_DISK_TASKS = 64;
+
+const uint64_t PRIME_1 = 0x9e3779b185ebca87ULL;
+const uint64_t PRIME_2 = 0xc2b2ae3d27d4eb4fULL;
+
+uint64_t
+rotate_left(uint64_t value, int bits)
+{
+  return (value << bits) | (value >> (64 - bits));
+}
+
+// Final avalanche of a lane, from MurmurHash3
+uint64_t
+mix(uint64_t value)
+{
+  value ^= value >> 33;
+  value *= 0xff51afd7ed558ccdULL;
+  value ^= value >> 33;
+  value *= 0xc4ceb9fe1a85ec53ULL;
+  value ^= value >> 33;
+  return value;
+}
+
+// Folds size bytes into two lanes, a word at a time
+void
+hash_bytes(const uint8_t* data, size_t size, uint64_t& high, uint64_t& low)
+{
+  size_t i = 0;
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    high = rotate_left(high ^ (word * PRIME_2), 31) * PRIME_1;
+    low = rotate_left(low ^ (word * PRIME_1), 27) * PRIME_2;
+  }
+  uint64_t tail = 0;
+  std::memcpy(&tail, data + i, size - i);
+  high = rotate_left(high ^ (tail * PRIME_2), 31) * PRIME_1;
+  low = rotate_left(low ^ (tail * PRIME_1), 27) * PRIME_2;
+}
+
+size_t
+get_mask_bytes(const cv::Mat& mask)
+{
+  return mask.total() * mask.elemSize();
+}
+
+void
+count_request(const std::string& result)
+{
+  utility::Metrics::get().add(
+      std::string(REQUESTS_METRIC) + "{result=\"" + result + "\"}",
+      REQUESTS_HELP, 1);
+}
+
+}  // namespace
+
+ResultCache::ResultCache(
+    const std::string& model_name, const std::string& model_version,
+    size_t memory_bytes, const std::string& directory, size_t disk_bytes)
+    : directory_(directory)
+{
+  uint64_t high = PRIME_1;
+  uint64_t low = PRIME_2;
+  std::string model = model_name + "\n" + model_version + "\nmasks";
+  hash_bytes(
+      reinterpret_cast<const uint8_t*>(model.data()), model.size(), high, low);
+  model_seed_ = mix(high ^ low);
+
+  memory_.max_bytes = memory_bytes;
+  disk_.max_bytes = disk_bytes;
+
+  std::ostringstream suffix;
+  suffix << "." << std::hex << std::random_device{}() << ".tmp";
+  temporary_suffix_ = suffix.str();
+
+  if (!directory_.empty()) {
+    std::error_code error;
+    fs::create_directories(directory_, error);
+    if (error) {
+      throw std::runtime_error(
+          "Failed to create cache directory " + directory_ + ": " +
+          error.message());
+    }
+    scan_directory();
+    disk_writer_ = std::make_unique<utility::WorkerThread>();
+  }
+}
+
+ResultCache::Key
+ResultCache::get_key(const cv::Mat& patch) const
+{
+  uint64_t high = model_seed_ ^ PRIME_1;
+  uint64_t low = model_seed_ ^ PRIME_2;
+  int32_t size[3] = {patch.rows, patch.cols, patch.type()};
+  hash_bytes(reinterpret_cast<const uint8_t*>(size), sizeof(size), high, low);
+
+  // Row by row, as patches may be views into a larger buffer
+  size_t row_bytes = patch.cols * patch.elemSize();
+  for (int row = 0; row < patch.rows; ++row) {
+    hash_bytes(patch.ptr<uint8_t>(row), row_bytes, high, low);
+  }
+
+  return {mix(high + low), mix(low + high * PRIME_1)};
+}
+
+cv::Mat
+ResultCache::find(const Key& key)
+{
+  {
+    std::lock_guard<std::mutex> lock(memory_mutex_);
+    auto found = memory_.index.find(key);
+    if (found != memory_.index.end()) {
+      memory_.entries.splice(
+          memory_.entries.end(), memory_.entries, found->second);
+      count_request("memory_hit");
+      return found->second->second;
+    }
+  }
+
+  if (disk_writer_) {
+    bool is_on_disk = false;
+    {
+      std::lock_guard<std::mutex> lock(disk_mutex_);
+      auto found = disk_.index.find(key);
+      if (found != disk_.index.end()) {
+        disk_.entries.splice(disk_.entries.end(), disk_.entries, found->second);
+        is_on_disk = true;
+      }
+    }
+    // The file may have been evicted in the meantime
+    cv::Mat mask = is_on_disk ? read_file(key) : cv::Mat();
+    if (!mask.empty()) {
+      insert_memory(key, mask);
+      queue_disk_task([this, key]() { touch_file(key); });
+      count_request("disk_hit");
+      return mask;
+    }
+  }
+
+  count_request("miss");
+  return cv::Mat();
+}
+
+void
+ResultCache::insert(const Key& key, const cv::Mat& mask)
+{
+  cv::Mat copy = mask.clone();
+  insert_memory(key, copy);
+  if (disk_writer_) {
+    queue_disk_task([this, key, copy]() { write_file(key, copy); });
+  }
+}
+
+void
+ResultCache::queue_disk_task(std::function<void()> task)
+{
+  // The disk tier is best effort, so rather than hold masks in memory while
+  // the disk is behind, tasks past the bound are dropped
+  if (pending_disk_tasks_.fetch_add(1) >= MAX_PENDING_DISK_TASKS) {
+    --pending_disk_tasks_;
+    utility::Metrics::get().add(SKIPPED_METRIC, SKIPPED_HELP, 1);
+    return;
+  }
+  disk_writer_->add_task([this, task]() {
+    --pending_disk_tasks_;
+    task();
+  });
+}
+
+void
+ResultCache::insert_memory(const Key& key, const cv::Mat& mask)
+{
+  size_t bytes = get_mask_bytes(mask);
+  if (bytes > memory_.max_bytes) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(memory_mutex_);
+  if (memory_.index.count(key) > 0) {
+    return;
+  }
+  memory_.entries.emplace_back(key, mask);
+  memory_.index[key] = std::prev(memory_.entries.end());
+  memory_.bytes += bytes;
+
+  while (memory_.bytes > memory_.max_bytes) {
+    const auto& oldest = memory_.entries.front();
+    memory_.bytes -= get_mask_bytes(oldest.second);
+    memory_.index.erase(oldest.first);
+    memory_.entries.pop_front();
+  }
+  utility::Metrics::get().set(MEMORY_BYTES_METRIC, BYTES_HELP, memory_.bytes);
+}
+
+cv::Mat
+ResultCache::read_file(const Key& key) const
+{
+  std::ifstream file(get_path(key), std::ios::binary);
+  int32_t size[2];
+  if (!file.read(reinterpret_cast<char*>(size), sizeof(size)) ||
+      size[0] <= 0 || size[1] <= 0) {
+    return cv::Mat();
+  }
+
+  cv::Mat mask(size[0], size[1], CV_8UC1);
+  if (!file.read(
+          reinterpret_cast<char*>(mask.data), get_mask_bytes(mask))) {
+    return cv::Mat();
+  }
+  return mask;
+}
+
+void
+ResultCache::write_file(const Key& key, const cv::Mat& mask)
+{
+  size_t bytes = HEADER_SIZE + get_mask_bytes(mask);
+  if (bytes > disk_.max_bytes) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(disk_mutex_);
+    if (disk_.index.count(key) > 0) {
+      return;
+    }
+  }
+
+  // Written aside and renamed, so that readers never see a partial file
+  std::string path = get_path(key);
+  std::string temporary_path = path + temporary_suffix_;
+  {
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+    int32_t size[2] = {mask.rows, mask.cols};
+    file.write(reinterpret_cast<const char*>(size), sizeof(size));
+    file.write(reinterpret_cast<const char*>(mask.data), get_mask_bytes(mask));
+    if (!file) {
+      std::cerr << "Failed to write cache file " << temporary_path
+                << std::endl;
+      return;
+    }
+  }
+  std::error_code error;
+  fs::rename(temporary_path, path, error);
+  if (error) {
+    std::cerr << "Failed to write cache file " << path << ": "
+              << error.message() << std::endl;
+    fs::remove(temporary_path, error);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(disk_mutex_);
+    add_file(key, bytes);
+  }
+
+  if (++writes_since_scan_ >= SCAN_INTERVAL_WRITES) {
+    writes_since_scan_ = 0;
+    scan_directory();
+  }
+}
+
+void
+ResultCache::touch_file(const Key& key)
+{
+  std::error_code error;
+  fs::last_write_time(get_path(key), fs::file_time_type::clock::now(), error);
+}
+
+void
+ResultCache::scan_directory()
+{
+  // Oldest files first, so that they are the first evicted. Files used by
+  // other processes are told apart by their write time, see touch_file.
+  std::vector<std::pair<fs::file_time_type, fs::path>> files;
+  fs::file_time_type stale_time =
+      fs::file_time_type::clock::now() - STALE_TEMPORARY_AGE;
+  std::error_code error;
+  for (fs::directory_iterator it(directory_, error), end; !error && it != end;
+       it.increment(error)) {
+    fs::file_time_type write_time = it->last_write_time(error);
+    if (error || !it->is_regular_file(error)) {
+      error.clear();
+      continue;
+    }
+    if (it->path().extension() == ".tmp") {
+      if (write_time < stale_time) {
+        fs::remove(it->path(), error);
+        error.clear();
+      }
+      continue;
+    }
+    files.emplace_back(write_time, it->path());
+  }
+  std::sort(files.begin(), files.end());
+
+  std::lock_guard<std::mutex> lock(disk_mutex_);
+  disk_.entries.clear();
+  disk_.index.clear();
+  disk_.bytes = 0;
+  for (const auto& file : files) {
+    std::string name = file.second.filename().string();
+    if (name.size() != 32 ||
+        name.find_first_not_of("0123456789abcdef") != std::string::npos) {
+      continue;
+    }
+    Key key{
+        std::stoull(name.substr(0, 16), nullptr, 16),
+        std::stoull(name.substr(16), nullptr, 16)};
+    size_t bytes = fs::file_size(file.second, error);
+    if (!error) {
+      add_file(key, bytes);
+    }
+    error.clear();
+  }
+}
+
+void
+ResultCache::add_file(const Key& key, size_t bytes)
+{
+  disk_.entries.emplace_back(key, bytes);
+  disk_.index[key] = std::prev(disk_.entries.end());
+  disk_.bytes += bytes;
+
+  std::error_code error;
+  while (disk_.bytes > disk_.max_bytes) {
+    const auto& oldest = disk_.entries.front();
+    fs::remove(get_path(oldest.first), error);
+    disk_.bytes -= oldest.second;
+    disk_.index.erase(oldest.first);
+    disk_.entries.pop_front();
+  }
+  utility::Metrics::get().set(DISK_BYTES_METRIC, BYTES_HELP, disk_.bytes);
+}
+
+std::string
+ResultCache::get_path(const Key& key) const
+{
+  std::ostringstream name;
+  name << std::hex << std::setfill('0') << std::setw(16) << key.high
+       << std::setw(16) << key.low;
+  return (fs::path(directory_) / name.str()).string();
+}
+
+}  // namespace client
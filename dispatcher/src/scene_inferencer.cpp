@@ -1,92 +1,681 @@
 #include "scene_inferencer.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
 #include <iostream>
+#include <mutex>
+#include <stdexcept>
 #include <thread>
 #include <vector>
 
+#include "buffer_pool.h"
 #include "gdal_image_loader.h"
 #include "gdal_image_saver.h"
+#include "metrics.h"
 #include "triton_client.h"
 
 namespace inference {
 
 const int MAX_HARDWARE_THREADS = std::thread::hardware_concurrency();
 
-// Method to perform the inference process
+namespace {
+
+// Gets the highest of the numbered versions of a model, the one requests for
+// the latest version go to
+std::string
+get_latest_version(const std::vector<std::string>& versions)
+{
+  std::string latest;
+  for (const std::string& version : versions) {
+    if (version.size() > latest.size() ||
+        (version.size() == latest.size() && version > latest)) {
+      latest = version;
+    }
+  }
+  return latest;
+}
+
+}  // namespace
+
+SceneInferencer::SceneInferencer(
+    int num_classes, const std::string& model_name,
+    const std::string& model_version, const std::string& url, int patch_size,
+    int stride_size, bool verbose, const InferenceOptions& options)
+    : num_classes_(num_classes), model_name_(model_name),
+      model_version_(model_version), url_(url), patch_size_(patch_size),
+      stride_size_(stride_size), verbose_(verbose), options_(options)
+{
+  transport_.request_compression = options_.request_compression;
+  transport_.response_compression = options_.response_compression;
+  transport_.mask_bits =
+      options_.pack_masks ? client::get_mask_bits(num_classes_) : 0;
+  utility::Metrics::get().set(
+      "dispatcher_transport_info{request_compression=\"" +
+          client::get_compression_name(transport_.request_compression) +
+          "\",response_compression=\"" +
+          client::get_compression_name(transport_.response_compression) +
+          "\",mask_bits=\"" + std::to_string(transport_.mask_bits) + "\"}",
+      "Tensor transport settings, mask_bits 0 for unpacked masks", 1);
+
+  // Unless set, enough batches in flight for every hardware thread's patch
+  // to be in one
+  if (options_.batch_size > 1) {
+    int max_in_flight =
+        options_.max_in_flight > 0
+            ? options_.max_in_flight
+            : std::max(1, MAX_HARDWARE_THREADS / options_.batch_size);
+    batcher_ = std::make_unique<client::InferenceBatcher>(
+        model_name_, model_version_, url_, verbose_, options_.batch_size,
+        options_.batch_linger_us, max_in_flight, options_.protocol,
+        options_.routing, transport_);
+    batcher_->set_latency_listener(
+        [this](std::chrono::steady_clock::duration round_trip) {
+          limiter_->add_round_trip(round_trip);
+        });
+  }
+
+  scheduler_ = std::make_unique<utility::TaskScheduler>(MAX_HARDWARE_THREADS);
+  limiter_ = std::make_unique<client::ConcurrencyLimiter>(
+      std::min(MAX_HARDWARE_THREADS, options_.max_concurrency), 1,
+      options_.max_concurrency);
+
+  // Filled once the model checks out, see check_model
+  client_pool_ = std::make_unique<client::ClientPool>(
+      [this]() { return create_client(); });
+}
+
+bool
+SceneInferencer::is_model_ready()
+{
+  return client_pool_->acquire()->is_model_ready();
+}
+
 void
+SceneInferencer::check_model()
+{
+  std::shared_ptr<client::TritonClient> client = client_pool_->acquire();
+  client::ModelMetadata metadata = client->get_model_metadata();
+
+  // Batches of 8-bit RGB patches of any size go in
+  auto input = std::find_if(
+      metadata.inputs.begin(), metadata.inputs.end(),
+      [](const client::TensorMetadata& tensor) {
+        return tensor.name == "images";
+      });
+  if (input == metadata.inputs.end()) {
+    throw ModelMismatchError("Model " + model_name_ + " has no images input.");
+  }
+  if (input->datatype != "UINT8") {
+    throw ModelMismatchError(
+        "Model input images is " + input->datatype + ", expected UINT8.");
+  }
+  const std::vector<int64_t>& shape = input->shape;
+  if (shape.size() != 4 || (shape[3] != 3 && shape[3] != -1)) {
+    throw ModelMismatchError(
+        "Model input images must be shaped (batch, height, width, 3).");
+  }
+  for (int axis = 1; axis < 3; ++axis) {
+    if (shape[axis] != -1 && shape[axis] != patch_size_) {
+      throw ModelMismatchError(
+          "Model input images takes " + std::to_string(shape[axis]) +
+          " pixels, patches are " + std::to_string(patch_size_) + ".");
+    }
+  }
+
+  // Masks, packed or not, and the probabilities soft voting blends
+  std::vector<std::string> expected_outputs = {
+      options_.pack_masks ? "packed_masks" : "masks"};
+  if (options_.soft_vote_scale > 0) {
+    expected_outputs.push_back("probabilities");
+  }
+  for (const std::string& name : expected_outputs) {
+    bool is_found = std::any_of(
+        metadata.outputs.begin(), metadata.outputs.end(),
+        [&name](const client::TensorMetadata& tensor) {
+          return tensor.name == name;
+        });
+    if (!is_found) {
+      throw ModelMismatchError(
+          "Model " + model_name_ + " has no " + name + " output.");
+    }
+  }
+
+  // The depth of the probabilities tells the classes the model segments into,
+  // which packed masks are packed to the bits of
+  auto probabilities = std::find_if(
+      metadata.outputs.begin(), metadata.outputs.end(),
+      [](const client::TensorMetadata& tensor) {
+        return tensor.name == "probabilities";
+      });
+  int64_t model_classes =
+      probabilities != metadata.outputs.end() && !probabilities->shape.empty()
+          ? probabilities->shape.back()
+          : -1;
+  if (model_classes > 0 && model_classes != num_classes_) {
+    throw ModelMismatchError(
+        "Model segments " + std::to_string(model_classes) +
+        " classes, the dispatcher " + std::to_string(num_classes_) +
+        " (see -n).");
+  }
+  if (model_classes <= 0 && options_.pack_masks) {
+    throw ModelMismatchError(
+        "Model " + model_name_ +
+        " does not publish its classes, which packed masks need.");
+  }
+
+  // One patch through the model, which also loads whatever it loads lazily
+  cv::Mat patch(patch_size_, patch_size_, CV_8UC3, cv::Scalar(0, 0, 0));
+  cv::Mat mask = client->request_inference(patch);
+  if (mask.rows != patch_size_ || mask.cols != patch_size_) {
+    throw ModelMismatchError("Model returned a mask of the wrong size.");
+  }
+
+  // Masks cached on disk outlive the model behind "latest", so they are
+  // keyed on the version the server actually serves
+  if (options_.cache_memory_mb > 0) {
+    std::string version = model_version_.empty()
+                              ? get_latest_version(metadata.versions)
+                              : model_version_;
+    size_t megabyte = 1024 * 1024;
+    result_cache_ = std::make_unique<client::ResultCache>(
+        model_name_, version, options_.cache_memory_mb * megabyte,
+        options_.cache_directory, options_.cache_disk_mb * megabyte);
+    if (verbose_) {
+      std::cout << "Caching masks of model " << model_name_ << " version "
+                << version << std::endl;
+    }
+  }
+
+  // A job's worth of connected clients, more are made for concurrent jobs
+  client_pool_->reserve(MAX_HARDWARE_THREADS);
+  if (verbose_) {
+    std::cout << "Model " << model_name_ << " checked and warmed up, "
+              << client_pool_->get_size() << " clients ready" << std::endl;
+  }
+}
+
+// Method to perform the inference process
+InferenceStats
 SceneInferencer::run_inference(
-    const std::string& image_path, const std::string& output_path)
+    const std::string& image_path, const std::string& output_path,
+    const JobOptions& job)
 {
   // Initialize image saver
-  scene::GdalImageSaver saver(output_path, num_classes_);
+  scene::GdalImageSaver saver(
+      output_path, num_classes_, options_.output_compression);
 
-  // Initialize separate loaders for each worker
-  std::vector<std::unique_ptr<utility::WorkerThread>> worker_threads;
-  std::vector<std::unique_ptr<client::TritonClient>> clients;
-  std::vector<std::unique_ptr<scene::GdalImageLoader>> loaders;
+  // Scene loader for the metadata, the scheduler threads open their own
+  JobResources resources;
+  resources.image_path = image_path;
+  resources.priority = job.priority;
+  resources.scene_loader = open_loader(image_path);
+  resources.scene_loader->init_band_stretch(options_.stretch_percentile);
+  resources.loaders.resize(scheduler_->get_size());
+  resources.clients.resize(scheduler_->get_size());
+  const auto& scene_loader = resources.scene_loader;
 
-  // Initialize the first worker
-  append_resources(worker_threads, clients, loaders, image_path);
+  // Resolve the area of interest to a pixel window
+  int width = scene_loader->get_image_width();
+  int height = scene_loader->get_image_height();
+  cv::Rect aoi = job.bbox.empty() ? job.window
+                                  : scene_loader->get_pixel_window(job.bbox);
+  if (!aoi.empty()) {
+    aoi &= cv::Rect(0, 0, width, height);
+    if (aoi.empty()) {
+      throw std::runtime_error("Area of interest lies outside of the image.");
+    }
+  }
 
   // Get patch coordinates from one of the loaders
-  std::vector<cv::Rect> coordinates = loaders[0]->get_patch_coordinates();
+  std::vector<cv::Rect> coordinates =
+      scene_loader->get_patch_coordinates(aoi, options_.patch_order);
   int total_patches = coordinates.size();
 
   // Pre-initialize the image saver
-  int width = loaders[0]->get_image_width();
-  int height = loaders[0]->get_image_height();
-  saver.init_gdal(width, height);
+  double geotransform[6];
+  saver.set_georeference(
+      scene_loader->get_geotransform(geotransform) ? geotransform : nullptr,
+      scene_loader->get_projection());
+  saver.init_gdal(width, height, aoi, job.update_output);
+  bool soft_voting = options_.soft_vote_scale > 0 && !job.center_crop;
+  saver.set_soft_voting(soft_voting ? options_.soft_vote_scale : 0);
+  saver.set_center_crop(job.center_crop);
+  saver.expect_patches(coordinates);
+
+  // Scheduler threads sharing out the patches in contiguous chunks unless
+  // patch_chunk_size is set, idle ones steal from them. How many requests
+  // they have in flight is up to limiter_.
+  int num_workers =
+      std::max(1, std::min(total_patches, scheduler_->get_size()));
 
-  int num_workers = std::min(
-      static_cast<int>(std::sqrt(total_patches) / scaling_factor_),
-      MAX_HARDWARE_THREADS);
+  // Share of the scheduler threads against concurrent jobs
+  double weight = std::ldexp(1.0, job.priority);
   if (verbose_) {
     std::cout << "Total number of patches: " << total_patches << std::endl;
     std::cout << "Image dimensions: " << width << " x " << height << std::endl;
+    if (!aoi.empty()) {
+      std::cout << "Area of interest: " << aoi << std::endl;
+    }
     std::cout << "Number of workers: " << num_workers << std::endl;
+    std::cout << "Priority: " << job.priority << std::endl;
+    std::cout << "Memory-mapped input: "
+              << (scene_loader->is_memory_mapped() ? "true" : "false")
+              << std::endl;
+    if (job.center_crop) {
+      std::cout << "Stitching: center crop" << std::endl;
+    } else if (soft_voting) {
+      std::cout << "Stitching: soft voting at 1/" << options_.soft_vote_scale
+                << " resolution" << std::endl;
+    }
+    std::cout << "Band stretch: "
+              << (scene_loader->needs_band_stretch() ? "true" : "false")
+              << std::endl;
   }
 
-  for (int worker_id = 1; worker_id < num_workers; ++worker_id) {
-    append_resources(worker_threads, clients, loaders, image_path);
+  // Segment the downsampled scene first when coarse-to-fine is enabled
+  cv::Mat coarse_labels;
+  int coarse_patches = 0;
+  if (options_.coarse_factor > 1) {
+    coarse_labels = run_coarse_pass(resources, num_workers, weight, aoi);
+    coarse_patches =
+        scene_loader->get_coarse_coordinates(options_.coarse_factor, aoi)
+            .size();
   }
 
-  // Distribute tasks to workers
-  std::vector<std::future<void>> futures;
-  for (int i = 0; i < total_patches; ++i) {
-    int worker_id = i % num_workers;  // Round-robin distribution of tasks
+  // Patch counters shared by the workers
+  std::atomic<int> inferred_patches(0);
+  std::atomic<int> skipped_patches(0);
+  std::atomic<int> upsampled_patches(0);
+
+  // Asynchronous requests still awaiting their completion, and the first
+  // error one of them ended with
+  std::mutex completion_mutex;
+  std::condition_variable completion_monitor;
+  int outstanding_requests = 0;
+  int max_outstanding_requests = options_.max_in_flight * num_workers;
+  std::exception_ptr completion_error;
 
-    futures.push_back(worker_threads[worker_id]->add_task([=, &saver, &clients,
-                                                           &loaders]() mutable {
-      const auto& coord = coordinates[i];
-      if (verbose_) {
-        std::cout << "Worker " << worker_id
-                  << " processing patch at coordinates: " << coord << std::endl;
+  // Patch and fill buffers recycled across the job's patches
+  utility::BufferPool patch_buffers;
+  utility::BufferPool fill_buffers;
+
+  auto process_patch = [&](int thread_id, int i) {
+    const auto& coord = coordinates[i];
+    if (verbose_) {
+      std::cout << "Thread " << thread_id
+                << " processing patch at coordinates: " << coord << std::endl;
+    }
+    scene::GdalImageLoader& loader = get_loader(resources, thread_id);
+    client::TritonClient& triton_client = get_client(resources, thread_id);
+    auto fill_patch = [&](int class_label) {
+      utility::BufferPool::Buffer labels = fill_buffers.acquire(coord.area());
+      cv::Mat mask(coord.height, coord.width, CV_8UC1, labels->data());
+      mask.setTo(cv::Scalar(class_label));
+      saver.save_patch(coord, mask);
+    };
+
+    // Patches lying inside a single coarse class are upsampled from it
+    if (!coarse_labels.empty()) {
+      int coarse_class = get_coarse_class(coarse_labels, coord);
+      if (coarse_class >= 0) {
+        fill_patch(coarse_class);
+        upsampled_patches++;
+        return;
+      }
+    }
+
+    // Sparse blocks need neither a read nor a model call
+    if (options_.skip_empty_patches && loader.is_patch_unwritten(coord)) {
+      fill_patch(options_.empty_class);
+      skipped_patches++;
+      return;
+    }
+
+    // Read straight into a shared-memory region when the server is local,
+    // and otherwise into a recycled buffer unless the patch is a view of the
+    // memory map
+    std::shared_ptr<client::SharedMemoryPool::Region> region =
+        batcher_ ? nullptr : triton_client.acquire_shared_memory();
+    utility::BufferPool::Buffer buffer;
+    uint8_t* patch_data = nullptr;
+    if (region) {
+      patch_data = region->address;
+    } else if (!loader.is_memory_mapped()) {
+      buffer = patch_buffers.acquire(static_cast<size_t>(coord.area()) * 3);
+      patch_data = buffer->data();
+    }
+    scene::ImagePatch patch =
+        patch_data ? loader.read_patch_into(
+                         coord, cv::Mat(
+                                    coord.height, coord.width, CV_8UC3,
+                                    patch_data))
+                   : loader.read_patch_from_coordinates(coord);
+    if (options_.skip_empty_patches &&
+        loader.classify_patch(patch) != scene::PatchContent::kData) {
+      fill_patch(options_.empty_class);
+      skipped_patches++;
+      return;
+    }
+
+    // Hand the patch over and move on, the completion saves it
+    if (options_.max_in_flight > 0) {
+      {
+        std::unique_lock<std::mutex> lock(completion_mutex);
+        completion_monitor.wait(lock, [&]() {
+          return outstanding_requests < max_outstanding_requests;
+        });
+        outstanding_requests++;
       }
-      scene::ImagePatch patch =
-          loaders[worker_id]->read_patch_from_coordinates(coord);
-      cv::Mat mask = clients[worker_id]->request_inference(patch.image);
+      // The patch's memory stays leased until the completion is gone
+      auto done = [&, coord, region, buffer](
+                      cv::Mat result, std::exception_ptr error) {
+        if (!error) {
+          try {
+            if (soft_voting) {
+              saver.save_probabilities(coord, result);
+            } else {
+              saver.save_patch(coord, result);
+            }
+            inferred_patches++;
+          }
+          catch (...) {
+            error = std::current_exception();
+          }
+        }
+        std::lock_guard<std::mutex> lock(completion_mutex);
+        if (error && !completion_error) {
+          completion_error = error;
+        }
+        outstanding_requests--;
+        completion_monitor.notify_all();
+      };
+      request_patch_async(
+          triton_client, patch.image, soft_voting, job.priority,
+          std::move(done));
+      return;
+    }
+
+    if (soft_voting) {
+      saver.save_probabilities(
+          coord,
+          request_probabilities(triton_client, patch.image, job.priority));
+    } else {
+      cv::Mat mask = request_mask(triton_client, patch.image, job.priority);
       saver.save_patch(coord, mask);
-    }));
+    }
+    inferred_patches++;
+  };
+  int chunk_size = options_.patch_chunk_size > 0
+                       ? options_.patch_chunk_size
+                       : (total_patches + num_workers - 1) / num_workers;
+  std::exception_ptr patch_error;
+  try {
+    scheduler_->run(total_patches, chunk_size, process_patch, weight);
+  }
+  catch (...) {
+    patch_error = std::current_exception();
   }
 
-  // Wait for all futures to complete
-  for (auto& future : futures) {
-    future.get();  // Blocking call to ensure all tasks are done
+  // Wait for the completions still to come, even after a failed patch, since
+  // they refer to the saver and the counters on this stack frame
+  {
+    std::unique_lock<std::mutex> lock(completion_mutex);
+    completion_monitor.wait(lock, [&]() { return outstanding_requests == 0; });
+    if (!patch_error) {
+      patch_error = completion_error;
+    }
+  }
+  if (patch_error) {
+    std::rethrow_exception(patch_error);
+  }
+
+  // Write out whatever the patches did not cover
+  saver.finalize();
+
+  InferenceStats stats;
+  stats.inferred_patches = inferred_patches;
+  stats.skipped_patches = skipped_patches;
+  stats.coarse_patches = coarse_patches;
+  stats.upsampled_patches = upsampled_patches;
+  if (verbose_) {
+    std::cout << "Inferred patches: " << stats.inferred_patches
+              << ", skipped patches: " << stats.skipped_patches
+              << ", coarse patches: " << stats.coarse_patches
+              << ", upsampled patches: " << stats.upsampled_patches
+              << std::endl;
+    std::cout << "Patch buffers allocated: "
+              << patch_buffers.get_allocated_count() << std::endl;
   }
+  return stats;
+}
+
+cv::Mat
+SceneInferencer::run_coarse_pass(
+    JobResources& resources, int num_workers, double weight,
+    const cv::Rect& aoi)
+{
+  const auto& scene_loader = resources.scene_loader;
+  int factor = options_.coarse_factor;
+  int width = scene_loader->get_image_width();
+  int height = scene_loader->get_image_height();
+  std::vector<cv::Rect> windows =
+      scene_loader->get_coarse_coordinates(factor, aoi);
+
+  // Label map at 1/factor of the scene resolution, written by disjoint
+  // windows apart from the clamped last row and column
+  cv::Mat coarse_labels(
+      (height + factor - 1) / factor, (width + factor - 1) / factor, CV_8UC1,
+      cv::Scalar(0));
+  cv::Rect bounds(0, 0, coarse_labels.cols, coarse_labels.rows);
+  std::mutex labels_mutex;
+
+  if (verbose_) {
+    std::cout << "Coarse pass: " << windows.size() << " windows at 1/"
+              << factor << " resolution" << std::endl;
+  }
+
+  auto segment_window = [&](int thread_id, int i) {
+    const cv::Rect& window = windows[i];
+    cv::Rect target(
+        window.x / factor, window.y / factor,
+        (window.width + factor - 1) / factor,
+        (window.height + factor - 1) / factor);
+    target &= bounds;
+
+    scene::ImagePatch patch =
+        get_loader(resources, thread_id)
+            .read_patch_from_coordinates(window, target.size());
+    cv::Mat mask = request_mask(
+        get_client(resources, thread_id), patch.image, resources.priority);
+
+    std::lock_guard<std::mutex> lock(labels_mutex);
+    mask.copyTo(coarse_labels(target));
+  };
+  int num_windows = windows.size();
+  scheduler_->run(
+      num_windows, (num_windows + num_workers - 1) / num_workers,
+      segment_window, weight);
+
+  return coarse_labels;
+}
+
+int
+SceneInferencer::get_coarse_class(
+    const cv::Mat& coarse_labels, const cv::Rect& coord)
+{
+  int factor = options_.coarse_factor;
+
+  // Look one coarse pixel beyond the patch, so that class boundaries running
+  // along its edge still get full-resolution inference
+  cv::Rect region(
+      coord.x / factor - 1, coord.y / factor - 1,
+      (coord.x + coord.width + factor - 1) / factor - coord.x / factor + 2,
+      (coord.y + coord.height + factor - 1) / factor - coord.y / factor + 2);
+  region &= cv::Rect(0, 0, coarse_labels.cols, coarse_labels.rows);
+
+  uint8_t coarse_class = coarse_labels.at<uint8_t>(region.y, region.x);
+  for (int y = region.y; y < region.y + region.height; ++y) {
+    const uint8_t* row = coarse_labels.ptr<uint8_t>(y);
+    for (int x = region.x; x < region.x + region.width; ++x) {
+      if (row[x] != coarse_class) {
+        return -1;
+      }
+    }
+  }
+  return coarse_class;
+}
+
+cv::Mat
+SceneInferencer::request_mask(
+    client::TritonClient& client, const cv::Mat& image, int priority)
+{
+  client::ResultCache::Key key{};
+  if (result_cache_) {
+    key = result_cache_->get_key(image);
+    cv::Mat mask = result_cache_->find(key);
+    if (!mask.empty()) {
+      return mask;
+    }
+  }
+
+  cv::Mat mask = limit_concurrency(priority, [&]() {
+    return batcher_ ? batcher_->request_inference(image).get()
+                    : client.request_inference(image);
+  });
+  if (result_cache_) {
+    result_cache_->insert(key, mask);
+  }
+  return mask;
+}
+
+cv::Mat
+SceneInferencer::request_probabilities(
+    client::TritonClient& client, const cv::Mat& image, int priority)
+{
+  return limit_concurrency(priority, [&]() {
+    return batcher_ ? batcher_->request_probabilities(image).get()
+                    : client.request_probabilities(image);
+  });
+}
+
+cv::Mat
+SceneInferencer::limit_concurrency(
+    int priority, const std::function<cv::Mat()>& request)
+{
+  limiter_->acquire(priority);
+  cv::Mat result;
+  try {
+    result = request();
+  }
+  catch (...) {
+    limiter_->release(true);
+    throw;
+  }
+  limiter_->release(false);
+  return result;
 }
 
 void
-SceneInferencer::append_resources(
-    std::vector<std::unique_ptr<utility::WorkerThread>>& worker_threads,
-    std::vector<std::unique_ptr<client::TritonClient>>& clients,
-    std::vector<std::unique_ptr<scene::GdalImageLoader>>& loaders,
-    const std::string& image_path)
+SceneInferencer::request_patch_async(
+    client::TritonClient& client, const cv::Mat& image, bool probabilities,
+    int priority, client::InferenceBatcher::Completion done)
+{
+  if (result_cache_ && !probabilities) {
+    client::ResultCache::Key key = result_cache_->get_key(image);
+    cv::Mat mask = result_cache_->find(key);
+    if (!mask.empty()) {
+      done(mask, nullptr);
+      return;
+    }
+    // The mask is only valid until done returns, the cache keeps a copy
+    done = [this, key, done = std::move(done)](
+               cv::Mat result, std::exception_ptr error) {
+      if (!error) {
+        result_cache_->insert(key, result);
+      }
+      done(result, error);
+    };
+  }
+
+  // The slot is given back as soon as the result is in, before it is saved
+  limiter_->acquire(priority);
+  done = [this, done = std::move(done)](
+             cv::Mat result, std::exception_ptr error) {
+    limiter_->release(error != nullptr);
+    done(result, error);
+  };
+
+  if (batcher_) {
+    batcher_->submit(image, probabilities, std::move(done));
+    return;
+  }
+
+  auto unbatch = [done](
+                     std::vector<cv::Mat> results, std::exception_ptr error) {
+    done(error ? cv::Mat() : results.front(), error);
+  };
+  if (probabilities) {
+    client.request_probabilities_async({image}, unbatch);
+  } else {
+    client.request_inference_async({image}, unbatch);
+  }
+}
+
+std::unique_ptr<scene::GdalImageLoader>
+SceneInferencer::open_loader(const std::string& image_path)
 {
-  loaders.push_back(std::make_unique<scene::GdalImageLoader>(
-      image_path, patch_size_, stride_size_));
-  worker_threads.push_back(std::make_unique<utility::WorkerThread>());
-  clients.push_back(std::make_unique<client::TritonClient>(
-      model_name_, model_version_, url_, verbose_));
+  return std::make_unique<scene::GdalImageLoader>(
+      image_path, patch_size_, stride_size_, options_.memory_map,
+      options_.bands);
+}
+
+scene::GdalImageLoader&
+SceneInferencer::get_loader(JobResources& resources, int thread_id)
+{
+  // Only the thread itself touches its slot
+  auto& loader = resources.loaders[thread_id];
+  if (!loader) {
+    loader = open_loader(resources.image_path);
+    // Scene statistics for the band stretch are computed once and shared
+    loader->set_band_stretch(resources.scene_loader->get_band_stretch());
+  }
+  return *loader;
+}
+
+client::TritonClient&
+SceneInferencer::get_client(JobResources& resources, int thread_id)
+{
+  auto& triton_client = resources.clients[thread_id];
+  if (!triton_client) {
+    triton_client = client_pool_->acquire();
+  }
+  return *triton_client;
+}
+
+std::unique_ptr<client::TritonClient>
+SceneInferencer::create_client()
+{
+  auto triton_client = std::make_unique<client::TritonClient>(
+      model_name_, model_version_, url_, verbose_, options_.protocol);
+  triton_client->set_routing(options_.routing);
+  triton_client->set_transport(transport_);
+  triton_client->set_latency_listener(
+      [this](std::chrono::steady_clock::duration round_trip) {
+        limiter_->add_round_trip(round_trip);
+      });
+  if (options_.max_in_flight > 0) {
+    triton_client->set_max_in_flight(options_.max_in_flight);
+  }
+  if (options_.shared_memory_regions > 0) {
+    size_t patch_area = static_cast<size_t>(patch_size_) * patch_size_;
+    triton_client->enable_shared_memory(
+        options_.shared_memory_regions, patch_area * 3, patch_area);
+  }
+  return triton_client;
 }
 
 }  // namespace inference
@@ -1,9 +1,48 @@
 #include "service.h"
 
+#include <chrono>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "metrics.h"
 #include "scene_inferencer.h"
 
 namespace service {
 
+namespace {
+
+// Pause between checks of whether the model is ready
+constexpr int WARM_UP_INTERVAL_MS = 2000;
+
+// Parses a comma-separated list of numbers, e.g. "0,0,1024,1024"
+std::vector<double>
+parse_number_list(const std::string& value, size_t expected_size)
+{
+  std::vector<double> numbers;
+  std::stringstream stream(value);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    numbers.push_back(std::stod(item));
+  }
+  if (numbers.size() != expected_size) {
+    throw std::invalid_argument(
+        "Expected " + std::to_string(expected_size) +
+        " comma-separated values: " + value);
+  }
+  return numbers;
+}
+
+}  // namespace
+
+InferenceService::~InferenceService()
+{
+  want_stop_ = true;
+  if (warm_up_thread_.joinable()) {
+    warm_up_thread_.join();
+  }
+}
+
 void
 InferenceService::start(int port)
 {
@@ -13,6 +52,21 @@ InferenceService::start(int port)
         handle_inference_request(req, res);
       });
 
+  // Readiness probe
+  server_->Get(
+      "/ready", [this](const httplib::Request& req, httplib::Response& res) {
+        handle_readiness_request(req, res);
+      });
+
+  // Prometheus metrics
+  server_->Get(
+      "/metrics", [](const httplib::Request& req, httplib::Response& res) {
+        res.set_content(
+            utility::Metrics::get().render(), "text/plain; version=0.0.4");
+      });
+
+  warm_up_thread_ = std::thread([this]() { warm_up(); });
+
   server_->set_read_timeout(0, 0);
   server_->set_write_timeout(0, 0);
 
@@ -20,28 +74,110 @@ InferenceService::start(int port)
   server_->listen("0.0.0.0", port);
 }
 
+void
+InferenceService::warm_up()
+{
+  while (!want_stop_) {
+    // Triton may still be starting or loading the model
+    bool is_model_ready = false;
+    try {
+      is_model_ready = inferencer_.is_model_ready();
+    }
+    catch (const std::exception& e) {
+      std::cerr << "Warning: " << e.what() << std::endl;
+    }
+
+    // A model that does not fit the dispatcher stays rejected, so that the
+    // deployment fails instead of the first job, while failing to reach it is
+    // retried
+    if (is_model_ready) {
+      try {
+        inferencer_.check_model();
+        is_ready_ = true;
+        std::cout << "Service is ready" << std::endl;
+        return;
+      }
+      catch (const inference::ModelMismatchError& e) {
+        std::lock_guard<std::mutex> lock(readiness_mutex_);
+        model_error_ = e.what();
+        std::cerr << "Error: Model check failed: " << model_error_
+                  << std::endl;
+        return;
+      }
+      catch (const std::exception& e) {
+        std::cerr << "Warning: Model check failed, retrying: " << e.what()
+                  << std::endl;
+      }
+    }
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(WARM_UP_INTERVAL_MS));
+  }
+}
+
+void
+InferenceService::handle_readiness_request(
+    const httplib::Request& req, httplib::Response& res)
+{
+  if (is_ready_) {
+    res.set_content("Ready.", "text/plain");
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(readiness_mutex_);
+  res.status = 503;
+  res.set_content(
+      model_error_.empty() ? "Waiting for the model."
+                           : "Model rejected: " + model_error_,
+      "text/plain");
+}
+
 void
 InferenceService::handle_inference_request(
     const httplib::Request& req, httplib::Response& res)
 {
-  {
-    std::unique_lock<std::mutex> lock(inference_mutex_);
-    cv_.wait(
-        lock, [this] { return active_requests_ < max_concurrent_requests_; });
-    active_requests_++;
+  if (!is_ready_) {
+    res.status = 503;
+    res.set_content("Service is not ready.", "text/plain");
+    return;
   }
 
   // Parse the request
   auto image_path = req.get_param_value("image_path");
   auto output_path = req.get_param_value("output_path");
+  inference::JobOptions job;
+  try {
+    job = parse_job_options(req);
+  }
+  catch (const std::exception& e) {
+    res.status = 400;
+    res.set_content(e.what(), "text/plain");
+    return;
+  }
+
+  // Slots go to the highest priority waiting, first come first served
+  // within a priority
+  {
+    std::unique_lock<std::mutex> lock(inference_mutex_);
+    auto waiting =
+        waiting_requests_.emplace(-job.priority, next_ticket_++).first;
+    cv_.wait(lock, [this, waiting] {
+      return active_requests_ < max_concurrent_requests_ &&
+             waiting_requests_.begin() == waiting;
+    });
+    waiting_requests_.erase(waiting);
+    active_requests_++;
+  }
+  // The next in line may find a slot still free
+  cv_.notify_all();
 
   if (verbose_) {
     std::cout << "Received inference request with image path: " << image_path
               << " and output path: " << output_path << std::endl;
   }
 
+  inference::InferenceStats stats;
   try {
-    inferencer_.run_inference(image_path, output_path);
+    stats = inferencer_.run_inference(image_path, output_path, job);
   }
   catch (const std::exception& e) {
     res.set_content(e.what(), "text/plain");
@@ -49,17 +185,78 @@ InferenceService::handle_inference_request(
       std::unique_lock<std::mutex> lock(inference_mutex_);
       active_requests_--;
     }
-    cv_.notify_one();
+    cv_.notify_all();
     return;
   }
 
   // Respond to the request
-  res.set_content("Inference completed successfully.", "text/plain");
+  res.set_content(
+      "Inference completed successfully. Inferred patches: " +
+          std::to_string(stats.inferred_patches) +
+          ", skipped patches: " + std::to_string(stats.skipped_patches) +
+          ", coarse patches: " + std::to_string(stats.coarse_patches) +
+          ", upsampled patches: " + std::to_string(stats.upsampled_patches) +
+          ".",
+      "text/plain");
   {
     std::unique_lock<std::mutex> lock(inference_mutex_);
     active_requests_--;
   }
-  cv_.notify_one();
+  cv_.notify_all();
+}
+
+inference::JobOptions
+InferenceService::parse_job_options(const httplib::Request& req)
+{
+  inference::JobOptions job;
+
+  // Pixel window as x,y,width,height
+  if (req.has_param("window")) {
+    std::vector<double> window =
+        parse_number_list(req.get_param_value("window"), 4);
+    job.window = cv::Rect(
+        static_cast<int>(window[0]), static_cast<int>(window[1]),
+        static_cast<int>(window[2]), static_cast<int>(window[3]));
+  }
+
+  // Georeferenced bounding box as min_x,min_y,max_x,max_y
+  if (req.has_param("bbox")) {
+    job.bbox = parse_number_list(req.get_param_value("bbox"), 4);
+  }
+
+  job.update_output = req.get_param_value("update_output") == "true";
+
+  // Stitching of overlapping patches, vote (default) or center_crop
+  if (req.has_param("stitch")) {
+    std::string stitch = req.get_param_value("stitch");
+    if (stitch != "vote" && stitch != "center_crop") {
+      throw std::runtime_error("Unknown stitch mode: " + stitch);
+    }
+    job.center_crop = stitch == "center_crop";
+  }
+
+  // Share of the patch throughput against concurrent jobs, doubling per
+  // step, and order of admission when all slots are taken
+  if (req.has_param("priority")) {
+    job.priority = std::stoi(req.get_param_value("priority"));
+    if (job.priority < inference::MIN_JOB_PRIORITY ||
+        job.priority > inference::MAX_JOB_PRIORITY) {
+      throw std::runtime_error(
+          "Priority must be between " +
+          std::to_string(inference::MIN_JOB_PRIORITY) + " and " +
+          std::to_string(inference::MAX_JOB_PRIORITY) + ".");
+    }
+  }
+
+  if (verbose_ && (!job.window.empty() || !job.bbox.empty())) {
+    std::cout << "Restricting inference to "
+              << (job.bbox.empty() ? "window " : "bounding box ")
+              << (job.bbox.empty() ? req.get_param_value("window")
+                                   : req.get_param_value("bbox"))
+              << std::endl;
+  }
+
+  return job;
 }
 
 }  // namespace service
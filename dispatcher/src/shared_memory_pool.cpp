@@ -0,0 +1,112 @@
+#include "shared_memory_pool.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace client {
+
+namespace {
+
+// Distinguishes the pools of one process
+std::atomic<int> next_pool_id(0);
+
+}  // namespace
+
+SharedMemoryPool::SharedMemoryPool(
+    int num_regions, size_t input_size, size_t output_size)
+{
+  if (num_regions <= 0 || input_size == 0) {
+    throw std::runtime_error("Invalid shared memory pool size.");
+  }
+
+  std::string prefix = "segmenter_" + std::to_string(getpid()) + "_" +
+                       std::to_string(next_pool_id++);
+  size_t byte_size = input_size + output_size;
+
+  for (int i = 0; i < num_regions; ++i) {
+    Region region;
+    region.name = prefix + "_" + std::to_string(i);
+    region.key = "/" + region.name;
+    region.input_size = input_size;
+    region.output_size = output_size;
+
+    int fd = shm_open(region.key.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+      throw std::runtime_error(
+          "Failed to create shared memory " + region.key + ": " +
+          std::strerror(errno));
+    }
+    void* address = MAP_FAILED;
+    if (ftruncate(fd, byte_size) == 0) {
+      address =
+          mmap(nullptr, byte_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (address == MAP_FAILED) {
+      shm_unlink(region.key.c_str());
+      throw std::runtime_error(
+          "Failed to map shared memory " + region.key + ": " +
+          std::strerror(errno));
+    }
+
+    region.address = static_cast<uint8_t*>(address);
+    regions_.push_back(region);
+    free_regions_.push_back(i);
+  }
+}
+
+SharedMemoryPool::~SharedMemoryPool()
+{
+  for (const Region& region : regions_) {
+    munmap(region.address, region.input_size + region.output_size);
+    shm_unlink(region.key.c_str());
+  }
+}
+
+std::shared_ptr<SharedMemoryPool::Region>
+SharedMemoryPool::acquire()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  monitor_.wait(lock, [this] { return !free_regions_.empty(); });
+  int index = free_regions_.back();
+  free_regions_.pop_back();
+
+  return std::shared_ptr<Region>(
+      &regions_[index], [this, index](Region*) { release(index); });
+}
+
+const SharedMemoryPool::Region*
+SharedMemoryPool::find_input(const uint8_t* data, size_t size) const
+{
+  for (const Region& region : regions_) {
+    if (data >= region.address &&
+        data + size <= region.address + region.input_size) {
+      return &region;
+    }
+  }
+  return nullptr;
+}
+
+const std::vector<SharedMemoryPool::Region>&
+SharedMemoryPool::get_regions() const
+{
+  return regions_;
+}
+
+void
+SharedMemoryPool::release(int index)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_regions_.push_back(index);
+  }
+  monitor_.notify_one();
+}
+
+}  // namespace client
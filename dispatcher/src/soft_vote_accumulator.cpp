@@ -0,0 +1,315 @@
+#include "soft_vote_accumulator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace scene {
+
+// Grid rows guarded by each stripe mutex
+const int GRID_ROWS_PER_STRIPE = 4;
+
+// Weight floor of the window, so that cells covered by a single patch edge
+// still get a blend
+const float MIN_WINDOW_WEIGHT = 1e-3f;
+
+namespace {
+
+// Gets a cosine window over extent cells, peaking at the patch centre
+std::vector<float>
+get_window(int extent)
+{
+  std::vector<float> window(extent);
+  for (int i = 0; i < extent; ++i) {
+    float s = std::sin(static_cast<float>(M_PI) * (i + 0.5f) / extent);
+    window[i] = std::max(s * s, MIN_WINDOW_WEIGHT);
+  }
+  return window;
+}
+
+// Merges a row into a list of ascending row ranges
+void
+append_row(std::vector<cv::Range>& ranges, int row)
+{
+  if (!ranges.empty() && ranges.back().end == row) {
+    ranges.back().end = row + 1;
+  } else {
+    ranges.push_back(cv::Range(row, row + 1));
+  }
+}
+
+}  // namespace
+
+SoftVoteAccumulator::SoftVoteAccumulator(
+    int width, int height, int num_classes, int scale)
+    : width_(width), height_(height), num_classes_(num_classes),
+      scale_(scale), grid_width_((width + scale - 1) / std::max(scale, 1)),
+      grid_height_((height + scale - 1) / std::max(scale, 1))
+{
+  if (width <= 0 || height <= 0 || num_classes <= 0 || scale <= 0) {
+    throw std::runtime_error("Invalid dimensions for soft vote accumulator.");
+  }
+
+  pending_patches_.assign(grid_height_, 0);
+  is_final_.assign(grid_height_, 0);
+  grid_rows_.resize(grid_height_);
+  stripe_mutexes_ = std::vector<std::mutex>(
+      (grid_height_ + GRID_ROWS_PER_STRIPE - 1) / GRID_ROWS_PER_STRIPE);
+  is_ready_.assign(grid_height_, 0);
+  is_handed_out_.assign(height_, 0);
+
+  // Every full-resolution row samples two neighbouring grid rows
+  dependent_rows_.assign(grid_height_, 0);
+  for (int y = 0; y < height_; ++y) {
+    float weight;
+    int cell = get_sample_cell(y, grid_height_, &weight);
+    dependent_rows_[cell]++;
+    if (cell + 1 < grid_height_) {
+      dependent_rows_[cell + 1]++;
+    }
+  }
+
+  column_cells_.resize(width_);
+  column_weights_.resize(width_);
+  for (int x = 0; x < width_; ++x) {
+    column_cells_[x] = get_sample_cell(x, grid_width_, &column_weights_[x]);
+  }
+}
+
+void
+SoftVoteAccumulator::expect_patch(const cv::Rect& roi)
+{
+  cv::Rect grid = to_grid(roi) & cv::Rect(0, 0, grid_width_, grid_height_);
+  for (int row = grid.y; row < grid.y + grid.height; ++row) {
+    pending_patches_[row]++;
+  }
+}
+
+std::vector<cv::Range>
+SoftVoteAccumulator::add_probabilities(
+    const cv::Rect& roi, const cv::Mat& probabilities)
+{
+  if (probabilities.channels() != num_classes_ ||
+      probabilities.depth() != CV_32F) {
+    throw std::runtime_error("Probabilities do not match the class count.");
+  }
+
+  // Bring the probabilities onto the grid cells the patch covers
+  cv::Rect grid = to_grid(roi);
+  cv::Mat cells = probabilities;
+  if (probabilities.size() != grid.size()) {
+    cv::resize(probabilities, cells, grid.size(), 0, 0, cv::INTER_LINEAR);
+  }
+
+  std::vector<float> window_x = get_window(grid.width);
+  std::vector<float> window_y = get_window(grid.height);
+  cv::Rect visible = grid & cv::Rect(0, 0, grid_width_, grid_height_);
+  int stride = num_classes_ + 1;
+
+  std::vector<int> final_grid_rows;
+  for (int row = visible.y; row < visible.y + visible.height; ++row) {
+    std::lock_guard<std::mutex> lock(get_stripe_mutex(row));
+    if (is_final_[row]) {
+      continue;  // Already blended, late patches cannot change it anymore
+    }
+
+    std::vector<float>& sums = grid_rows_[row];
+    if (sums.empty()) {
+      sums.assign(static_cast<size_t>(grid_width_) * stride, 0.0f);
+    }
+
+    const float* source = cells.ptr<float>(row - grid.y);
+    float row_weight = window_y[row - grid.y];
+    for (int x = visible.x; x < visible.x + visible.width; ++x) {
+      float weight = row_weight * window_x[x - grid.x];
+      const float* cell =
+          source + static_cast<size_t>(x - grid.x) * num_classes_;
+      float* sum = sums.data() + static_cast<size_t>(x) * stride;
+      for (int c = 0; c < num_classes_; ++c) {
+        sum[c] += weight * cell[c];
+      }
+      sum[num_classes_] += weight;
+    }
+
+    if (--pending_patches_[row] <= 0) {
+      final_grid_rows.push_back(row);
+    }
+  }
+
+  std::vector<cv::Range> final_rows;
+  for (int row : final_grid_rows) {
+    for (const cv::Range& rows : make_final(row)) {
+      final_rows.push_back(rows);
+    }
+  }
+  return final_rows;
+}
+
+std::vector<cv::Range>
+SoftVoteAccumulator::add_labels(const cv::Rect& roi, const cv::Mat& labels)
+{
+  cv::Rect grid = to_grid(roi);
+  cv::Mat cell_labels;
+  cv::resize(labels, cell_labels, grid.size(), 0, 0, cv::INTER_NEAREST);
+
+  cv::Mat probabilities(
+      grid.height, grid.width, CV_32FC(num_classes_), cv::Scalar(0));
+  for (int y = 0; y < grid.height; ++y) {
+    const uint8_t* row_labels = cell_labels.ptr<uint8_t>(y);
+    float* row = probabilities.ptr<float>(y);
+    for (int x = 0; x < grid.width; ++x) {
+      if (row_labels[x] < num_classes_) {
+        row[static_cast<size_t>(x) * num_classes_ + row_labels[x]] = 1.0f;
+      }
+    }
+  }
+  return add_probabilities(roi, probabilities);
+}
+
+std::vector<cv::Range>
+SoftVoteAccumulator::finish()
+{
+  std::vector<cv::Range> final_rows;
+  for (int row = 0; row < grid_height_; ++row) {
+    for (const cv::Range& rows : make_final(row)) {
+      final_rows.push_back(rows);
+    }
+  }
+  return final_rows;
+}
+
+void
+SoftVoteAccumulator::take_labels(const cv::Range& rows, uint8_t* labels)
+{
+  int stride = num_classes_ + 1;
+
+  for (int y = rows.start; y < rows.end; ++y) {
+    float weight_y;
+    int cell_y = get_sample_cell(y, grid_height_, &weight_y);
+    int next_y = std::min(cell_y + 1, grid_height_ - 1);
+    const std::vector<float>& upper = grid_rows_[cell_y];
+    const std::vector<float>& lower = grid_rows_[next_y];
+    uint8_t* row_labels =
+        labels + static_cast<size_t>(y - rows.start) * width_;
+
+    if (upper.empty() || lower.empty()) {
+      std::fill(row_labels, row_labels + width_, 0);
+    } else {
+      for (int x = 0; x < width_; ++x) {
+        int cell_x = column_cells_[x];
+        int next_x = std::min(cell_x + 1, grid_width_ - 1);
+        float weight_x = column_weights_[x];
+
+        // Bilinear blend of the four surrounding cells, then argmax
+        const float* a = upper.data() + static_cast<size_t>(cell_x) * stride;
+        const float* b = upper.data() + static_cast<size_t>(next_x) * stride;
+        const float* c = lower.data() + static_cast<size_t>(cell_x) * stride;
+        const float* d = lower.data() + static_cast<size_t>(next_x) * stride;
+        int best_class = 0;
+        float best = -1.0f;
+        for (int k = 0; k < num_classes_; ++k) {
+          float top = a[k] + weight_x * (b[k] - a[k]);
+          float bottom = c[k] + weight_x * (d[k] - c[k]);
+          float p = top + weight_y * (bottom - top);
+          if (p > best) {
+            best = p;
+            best_class = k;
+          }
+        }
+        row_labels[x] = best_class;
+      }
+    }
+
+    // Release grid rows once every full-resolution row sampling them is taken
+    std::lock_guard<std::mutex> lock(ready_mutex_);
+    if (--dependent_rows_[cell_y] == 0) {
+      std::vector<float>().swap(grid_rows_[cell_y]);
+    }
+    if (next_y != cell_y && --dependent_rows_[next_y] == 0) {
+      std::vector<float>().swap(grid_rows_[next_y]);
+    }
+  }
+}
+
+cv::Rect
+SoftVoteAccumulator::to_grid(const cv::Rect& roi) const
+{
+  int x0 = static_cast<int>(std::floor(static_cast<double>(roi.x) / scale_));
+  int y0 = static_cast<int>(std::floor(static_cast<double>(roi.y) / scale_));
+  int x1 = static_cast<int>(
+      std::ceil(static_cast<double>(roi.x + roi.width) / scale_));
+  int y1 = static_cast<int>(
+      std::ceil(static_cast<double>(roi.y + roi.height) / scale_));
+  return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+int
+SoftVoteAccumulator::get_sample_cell(
+    int index, int grid_extent, float* weight) const
+{
+  // Cell centres sit at (cell + 0.5) * scale in full-resolution pixels
+  float position = (index + 0.5f) / scale_ - 0.5f;
+  if (position <= 0.0f) {
+    *weight = 0.0f;
+    return 0;
+  }
+  int cell = static_cast<int>(position);
+  if (cell >= grid_extent - 1) {
+    *weight = 0.0f;
+    return grid_extent - 1;
+  }
+  *weight = position - cell;
+  return cell;
+}
+
+std::vector<cv::Range>
+SoftVoteAccumulator::make_final(int grid_row)
+{
+  {
+    std::lock_guard<std::mutex> lock(get_stripe_mutex(grid_row));
+    if (is_final_[grid_row]) {
+      return {};
+    }
+    is_final_[grid_row] = 1;
+
+    // Turn weighted sums into probabilities
+    std::vector<float>& sums = grid_rows_[grid_row];
+    int stride = num_classes_ + 1;
+    for (size_t i = 0; i < sums.size(); i += stride) {
+      float total = sums[i + num_classes_];
+      if (total > 0.0f) {
+        for (int c = 0; c < num_classes_; ++c) {
+          sums[i + c] /= total;
+        }
+      }
+    }
+  }
+
+  // Hand out the full-resolution rows whose grid rows are now both final
+  std::vector<cv::Range> final_rows;
+  std::lock_guard<std::mutex> lock(ready_mutex_);
+  is_ready_[grid_row] = 1;
+  int first = std::max(0, (grid_row - 1) * scale_);
+  int last = std::min(height_, (grid_row + 2) * scale_);
+  for (int y = first; y < last; ++y) {
+    if (is_handed_out_[y]) {
+      continue;
+    }
+    float weight;
+    int cell = get_sample_cell(y, grid_height_, &weight);
+    int next = std::min(cell + 1, grid_height_ - 1);
+    if (is_ready_[cell] && is_ready_[next]) {
+      is_handed_out_[y] = 1;
+      append_row(final_rows, y);
+    }
+  }
+  return final_rows;
+}
+
+std::mutex&
+SoftVoteAccumulator::get_stripe_mutex(int grid_row) const
+{
+  return stripe_mutexes_[grid_row / GRID_ROWS_PER_STRIPE];
+}
+
+}  // namespace scene
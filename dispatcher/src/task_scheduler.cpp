@@ -0,0 +1,150 @@
+#include "task_scheduler.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace utility {
+
+TaskScheduler::TaskScheduler(int num_threads)
+{
+  if (num_threads <= 0) {
+    num_threads =
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    threads_.emplace_back([this, i] { thread_loop(i); });
+  }
+}
+
+TaskScheduler::~TaskScheduler()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    want_stop_ = true;
+  }
+  monitor_.notify_all();
+  for (auto& thread : threads_) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+}
+
+int
+TaskScheduler::get_size() const
+{
+  return threads_.size();
+}
+
+void
+TaskScheduler::run(int count, int chunk_size, const Body& body, double weight)
+{
+  if (count <= 0) {
+    return;
+  }
+  if (weight <= 0.0 || chunk_size <= 0) {
+    throw std::runtime_error("Invalid task weight or chunk size.");
+  }
+
+  Group group;
+  group.body = &body;
+  group.weight = weight;
+  group.count = count;
+  group.chunk_size = chunk_size;
+  group.cursor = 0;
+  group.runs.assign(get_size(), Run{0, 0});
+  group.queued = count;
+  group.remaining = count;
+
+  // A call joining starts at the current virtual time, with no credit for
+  // the time it was not competing
+  std::unique_lock<std::mutex> lock(mutex_);
+  group.start_tag = virtual_time_;
+  groups_.push_back(&group);
+  monitor_.notify_all();
+
+  group.monitor.wait(lock, [&group] { return group.remaining == 0; });
+  if (group.error) {
+    std::rethrow_exception(group.error);
+  }
+}
+
+bool
+TaskScheduler::take_task(int thread_id, Task& task)
+{
+  auto next = std::min_element(
+      groups_.begin(), groups_.end(), [](const Group* a, const Group* b) {
+        return a->start_tag < b->start_tag;
+      });
+  if (next == groups_.end()) {
+    return false;
+  }
+  Group& group = **next;
+
+  // The thread's own chunk, or else the next one in order, or else the far
+  // end of the longest one, so as to disturb its owner least
+  Run* run = &group.runs[thread_id];
+  if (run->next == run->end && group.cursor < group.count) {
+    run->next = group.cursor;
+    run->end = std::min(group.cursor + group.chunk_size, group.count);
+    group.cursor = run->end;
+  }
+  if (run->next < run->end) {
+    task.index = run->next++;
+  } else {
+    Run* longest = &*std::max_element(
+        group.runs.begin(), group.runs.end(), [](const Run& a, const Run& b) {
+          return a.end - a.next < b.end - b.next;
+        });
+    task.index = --longest->end;
+  }
+  task.group = &group;
+
+  virtual_time_ = group.start_tag;
+  group.start_tag += 1.0 / group.weight;
+  if (--group.queued == 0) {
+    groups_.erase(next);
+  }
+  return true;
+}
+
+void
+TaskScheduler::execute(int thread_id, const Task& task)
+{
+  Group& group = *task.group;
+  std::exception_ptr error;
+  try {
+    (*group.body)(thread_id, task.index);
+  }
+  catch (...) {
+    error = std::current_exception();
+  }
+
+  // The waiting run call may return, and the group go away, as soon as the
+  // lock is released
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (error && !group.error) {
+    group.error = error;
+  }
+  if (--group.remaining == 0) {
+    group.monitor.notify_all();
+  }
+}
+
+void
+TaskScheduler::thread_loop(int thread_id)
+{
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      monitor_.wait(lock, [this] { return want_stop_ || !groups_.empty(); });
+      if (!take_task(thread_id, task)) {
+        return;
+      }
+    }
+    execute(thread_id, task);
+  }
+}
+
+}  // namespace utility
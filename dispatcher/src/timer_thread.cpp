@@ -0,0 +1,71 @@
+#include "timer_thread.h"
+
+#include <iostream>
+
+namespace utility {
+
+TimerThread::TimerThread()
+{
+  thread_ = std::thread([this] { thread_loop(); });
+}
+
+TimerThread::~TimerThread()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    want_stop_ = true;
+  }
+  monitor_.notify_one();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void
+TimerThread::schedule(
+    std::chrono::steady_clock::duration delay, std::function<void()> task)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.emplace(std::chrono::steady_clock::now() + delay, std::move(task));
+  }
+  monitor_.notify_one();
+}
+
+void
+TimerThread::thread_loop()
+{
+  while (true) {
+    std::function<void()> task;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (true) {
+        if (tasks_.empty()) {
+          if (want_stop_) {
+            return;
+          }
+          monitor_.wait(lock);
+          continue;
+        }
+        // Once stopping, the remaining tasks run right away
+        auto next = tasks_.begin();
+        if (want_stop_ || next->first <= std::chrono::steady_clock::now()) {
+          task = std::move(next->second);
+          tasks_.erase(next);
+          break;
+        }
+        monitor_.wait_until(lock, next->first);
+      }
+    }
+
+    try {
+      task();
+    }
+    catch (const std::exception& e) {
+      std::cerr << "Timer task failed: " << e.what() << std::endl;
+    }
+  }
+}
+
+}  // namespace utility
@@ -1,93 +1,1170 @@
 #include "triton_client.h"
 
-#include <cstring>
+#include <algorithm>
+#include <future>
+#include <random>
+#include <rapidjson/document.h>
+#include <sstream>
 #include <stdexcept>
+#include <zlib.h>
+
+#include "metrics.h"
 
 namespace client {
 
+namespace {
+
+// Failures in a row after which an endpoint's circuit opens, and how long it
+// first stays open, doubling while its trial attempts keep failing
+const int CIRCUIT_FAILURE_THRESHOLD = 3;
+const int CIRCUIT_OPEN_MS = 1000;
+const int CIRCUIT_MAX_OPEN_MS = 30000;
+
+// Cap of the backoff before the first retry, doubling with every retry up to
+// the retry interval
+const int BACKOFF_BASE_MS = 100;
+
+// Weight of a new latency in an endpoint's moving average
+const double LATENCY_SMOOTHING = 0.2;
+
+// Recent latencies kept for the hedging threshold, how many are needed
+// before hedging starts, and how often the threshold is recomputed
+const size_t LATENCY_SAMPLES = 512;
+const size_t MIN_LATENCY_SAMPLES = 32;
+const size_t HEDGE_THRESHOLD_PERIOD = 16;
+
+// Splits a comma-separated list of URLs
+std::vector<std::string>
+split_urls(const std::string& urls)
+{
+  std::vector<std::string> result;
+  std::stringstream stream(urls);
+  std::string url;
+  while (std::getline(stream, url, ',')) {
+    if (!url.empty()) {
+      result.push_back(url);
+    }
+  }
+  if (result.empty()) {
+    throw std::invalid_argument("No Triton server URL given.");
+  }
+  return result;
+}
+
+tc::InferenceServerHttpClient::CompressionType
+get_http_compression(Compression compression)
+{
+  switch (compression) {
+    case Compression::kDeflate:
+      return tc::InferenceServerHttpClient::CompressionType::DEFLATE;
+    case Compression::kGzip:
+      return tc::InferenceServerHttpClient::CompressionType::GZIP;
+    default:
+      return tc::InferenceServerHttpClient::CompressionType::NONE;
+  }
+}
+
+tc::GrpcCompressionAlgorithm
+get_grpc_compression(Compression compression)
+{
+  switch (compression) {
+    case Compression::kDeflate:
+      return tc::GrpcCompressionAlgorithm::COMPRESS_DEFLATE;
+    case Compression::kGzip:
+      return tc::GrpcCompressionAlgorithm::COMPRESS_GZIP;
+    default:
+      return tc::GrpcCompressionAlgorithm::COMPRESS_NONE;
+  }
+}
+
+// Tensors of each kind between samples of their compression ratio, and the
+// weight of a new sample in the smoothed ratio
+const uint64_t COMPRESSION_SAMPLE_PERIOD = 64;
+const double COMPRESSION_SMOOTHING = 0.25;
+
+// Gets the size of a tensor compressed the way the Triton client and server
+// compress bodies, with zlib at its default level
+size_t
+get_compressed_size(const cv::Mat& tensor, Compression compression)
+{
+  z_stream stream{};
+  int window_bits = compression == Compression::kGzip ? 15 + 16 : 15;
+  if (deflateInit2(
+          &stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8,
+          Z_DEFAULT_STRATEGY) != Z_OK) {
+    return tensor.total() * tensor.elemSize();
+  }
+
+  // Row by row, as input images may be views into a larger buffer
+  std::vector<uint8_t> buffer(64 * 1024);
+  size_t row_bytes = tensor.cols * tensor.elemSize();
+  size_t size = 0;
+  for (int row = 0; row < tensor.rows; ++row) {
+    stream.next_in = const_cast<Bytef*>(tensor.ptr<uint8_t>(row));
+    stream.avail_in = static_cast<uInt>(row_bytes);
+    int flush = row + 1 == tensor.rows ? Z_FINISH : Z_NO_FLUSH;
+    do {
+      stream.next_out = buffer.data();
+      stream.avail_out = static_cast<uInt>(buffer.size());
+      deflate(&stream, flush);
+      size += buffer.size() - stream.avail_out;
+    } while (stream.avail_out == 0);
+  }
+  deflateEnd(&stream);
+  return size;
+}
+
+// Gets the bytes raw_bytes of tensors of a kind take on the wire. Neither
+// Triton client reports them, so one tensor of the kind in
+// COMPRESSION_SAMPLE_PERIOD is compressed here, and the bytes are scaled by
+// the smoothed ratio of those samples.
+double
+get_wire_bytes(
+    const std::string& kind, Compression compression, const cv::Mat& sample,
+    double raw_bytes)
+{
+  if (compression == Compression::kNone) {
+    return raw_bytes;
+  }
+
+  struct Samples {
+    uint64_t count = 0;
+    double ratio = 1.0;
+  };
+  static std::mutex mutex;
+  static std::map<std::string, Samples> samples_by_kind;
+
+  bool is_sampled;
+  double ratio;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Samples& samples = samples_by_kind[kind];
+    is_sampled = samples.count++ % COMPRESSION_SAMPLE_PERIOD == 0;
+    ratio = samples.ratio;
+  }
+  if (is_sampled && !sample.empty()) {
+    double sample_ratio =
+        static_cast<double>(get_compressed_size(sample, compression)) /
+        (sample.total() * sample.elemSize());
+    std::lock_guard<std::mutex> lock(mutex);
+    Samples& samples = samples_by_kind[kind];
+    samples.ratio =
+        samples.count == 1
+            ? sample_ratio
+            : samples.ratio +
+                  (sample_ratio - samples.ratio) * COMPRESSION_SMOOTHING;
+    ratio = samples.ratio;
+  }
+  return raw_bytes * ratio;
+}
+
+// Gets the tensors listed in a section of the JSON metadata, a name, datatype
+// and shape each
+std::vector<TensorMetadata>
+parse_tensors(const rapidjson::Value& metadata, const char* section)
+{
+  std::vector<TensorMetadata> tensors;
+  auto list = metadata.FindMember(section);
+  if (list == metadata.MemberEnd()) {
+    return tensors;
+  }
+  if (!list->value.IsArray()) {
+    throw std::runtime_error(
+        "Model metadata " + std::string(section) + " is not a list.");
+  }
+  for (const rapidjson::Value& entry : list->value.GetArray()) {
+    if (!entry.IsObject()) {
+      throw std::runtime_error("Model metadata lists a tensor badly.");
+    }
+    auto name = entry.FindMember("name");
+    auto datatype = entry.FindMember("datatype");
+    auto shape = entry.FindMember("shape");
+    if (name == entry.MemberEnd() || !name->value.IsString() ||
+        datatype == entry.MemberEnd() || !datatype->value.IsString() ||
+        shape == entry.MemberEnd() || !shape->value.IsArray()) {
+      throw std::runtime_error("Model metadata lists a tensor badly.");
+    }
+    TensorMetadata tensor;
+    tensor.name = name->value.GetString();
+    tensor.datatype = datatype->value.GetString();
+    for (const rapidjson::Value& dimension : shape->value.GetArray()) {
+      if (!dimension.IsInt64()) {
+        throw std::runtime_error(
+            "Model metadata gives tensor " + tensor.name + " a bad shape.");
+      }
+      tensor.shape.push_back(dimension.GetInt64());
+    }
+    tensors.push_back(tensor);
+  }
+  return tensors;
+}
+
+}  // namespace
+
+Protocol
+parse_protocol(const std::string& name)
+{
+  if (name == "http") {
+    return Protocol::kHttp;
+  }
+  if (name == "grpc") {
+    return Protocol::kGrpc;
+  }
+  throw std::invalid_argument("Unknown protocol: " + name);
+}
+
+Compression
+parse_compression(const std::string& name)
+{
+  if (name == "none") {
+    return Compression::kNone;
+  }
+  if (name == "deflate") {
+    return Compression::kDeflate;
+  }
+  if (name == "gzip") {
+    return Compression::kGzip;
+  }
+  throw std::invalid_argument("Unknown compression: " + name);
+}
+
+std::string
+get_compression_name(Compression compression)
+{
+  switch (compression) {
+    case Compression::kDeflate:
+      return "deflate";
+    case Compression::kGzip:
+      return "gzip";
+    default:
+      return "none";
+  }
+}
+
+int
+get_mask_bits(int num_classes)
+{
+  for (int bits : {1, 2, 4}) {
+    if (num_classes <= 1 << bits) {
+      return bits;
+    }
+  }
+  return 8;
+}
+
+Balancing
+parse_balancing(const std::string& name)
+{
+  if (name == "least") {
+    return Balancing::kLeastOutstanding;
+  }
+  if (name == "latency") {
+    return Balancing::kLatency;
+  }
+  throw std::invalid_argument("Unknown balancing: " + name);
+}
+
 TritonClient::TritonClient(
     const std::string& model_name, const std::string& model_version,
-    const std::string& server_url, bool verbose, int max_retries,
-    int retry_interval)
+    const std::string& server_url, bool verbose, Protocol protocol,
+    int max_retries, int retry_interval)
     : model_name_(model_name), model_version_(model_version),
-      server_url_(server_url), verbose_(verbose), max_retries_(max_retries),
-      retry_interval_(retry_interval)
+      verbose_(verbose), max_retries_(std::max(1, max_retries)),
+      retry_interval_(retry_interval), protocol_(protocol),
+      next_latency_sample_(0), hedge_threshold_ms_(0), next_request_id_(0),
+      max_in_flight_(1), in_flight_(0), live_requests_(0),
+      timer_(std::make_unique<utility::TimerThread>())
 {
-  tc::Error err =
-      tc::InferenceServerHttpClient::Create(&client_, server_url_, verbose_);
-  if (!err.IsOk()) {
-    throw std::runtime_error(
-        "Failed to create Triton client: " + err.Message());
+  for (const std::string& url : split_urls(server_url)) {
+    auto endpoint = std::make_unique<Endpoint>();
+    endpoint->url = url;
+    tc::Error err = protocol_ == Protocol::kGrpc
+                        ? tc::InferenceServerGrpcClient::Create(
+                              &endpoint->grpc_client, url, verbose_)
+                        : tc::InferenceServerHttpClient::Create(
+                              &endpoint->http_client, url, verbose_);
+    if (!err.IsOk()) {
+      throw std::runtime_error(
+          "Failed to create Triton client for " + url + ": " +
+          err.Message());
+    }
+
+    // Check if the server is alive, an endpoint that is not yet will be
+    // circuit broken once requests fail
+    bool is_server_live;
+    err = protocol_ == Protocol::kGrpc
+              ? endpoint->grpc_client->IsServerLive(&is_server_live)
+              : endpoint->http_client->IsServerLive(&is_server_live);
+    if (!err.IsOk()) {
+      std::cerr << "Warning: Failed to check liveness of " << url << ": "
+                << err.Message() << std::endl;
+    } else {
+      std::cout << "Server liveness check of " << url << ": "
+                << (is_server_live ? "Server is live." : "Server is not live.")
+                << std::endl;
+    }
+    endpoints_.push_back(std::move(endpoint));
   }
+}
 
-  // Check if the server is alive
-  bool is_server_live;
-  err = client_->IsServerLive(&is_server_live);
-  if (!err.IsOk()) {
-    std::cerr << "Warning: Failed to check server liveness: " << err.Message()
-              << std::endl;
-  } else {
-    std::cout << "Server liveness check: "
-              << (is_server_live ? "Server is live." : "Server is not live.")
-              << std::endl;
+TritonClient::~TritonClient()
+{
+  {
+    std::unique_lock<std::mutex> lock(in_flight_mutex_);
+    in_flight_monitor_.wait(lock, [this] { return live_requests_ == 0; });
+  }
+
+  for (const std::unique_ptr<Endpoint>& endpoint : endpoints_) {
+    if (endpoint->is_stream_started) {
+      endpoint->grpc_client->StopStream();
+    }
+
+    // Let the server drop its mappings before the regions are unlinked
+    if (!shared_memory_) {
+      continue;
+    }
+    for (const SharedMemoryPool::Region& region :
+         shared_memory_->get_regions()) {
+      if (protocol_ == Protocol::kGrpc) {
+        endpoint->grpc_client->UnregisterSystemSharedMemory(region.name);
+      } else {
+        endpoint->http_client->UnregisterSystemSharedMemory(region.name);
+      }
+    }
   }
 }
 
 cv::Mat
 TritonClient::request_inference(const cv::Mat& image)
 {
-  if (image.empty()) {
-    throw std::runtime_error("Error: Image is empty");
+  return request_inference(std::vector<cv::Mat>{image}).front();
+}
+
+std::vector<cv::Mat>
+TritonClient::request_inference(const std::vector<cv::Mat>& images)
+{
+  return infer(images, "masks");
+}
+
+cv::Mat
+TritonClient::request_probabilities(const cv::Mat& image)
+{
+  return request_probabilities(std::vector<cv::Mat>{image}).front();
+}
+
+std::vector<cv::Mat>
+TritonClient::request_probabilities(const std::vector<cv::Mat>& images)
+{
+  return infer(images, "probabilities");
+}
+
+void
+TritonClient::request_inference_async(
+    const std::vector<cv::Mat>& images, Completion done)
+{
+  infer_async(images, "masks", std::move(done));
+}
+
+void
+TritonClient::request_probabilities_async(
+    const std::vector<cv::Mat>& images, Completion done)
+{
+  infer_async(images, "probabilities", std::move(done));
+}
+
+bool
+TritonClient::is_model_ready()
+{
+  for (const std::unique_ptr<Endpoint>& endpoint : endpoints_) {
+    bool is_ready = false;
+    tc::Error err = protocol_ == Protocol::kGrpc
+                        ? endpoint->grpc_client->IsModelReady(
+                              &is_ready, model_name_, model_version_)
+                        : endpoint->http_client->IsModelReady(
+                              &is_ready, model_name_, model_version_);
+    if (!err.IsOk() && verbose_) {
+      std::cerr << "Warning: Failed to check model readiness on "
+                << endpoint->url << ": " << err.Message() << std::endl;
+    }
+    if (err.IsOk() && is_ready) {
+      return true;
+    }
+  }
+  return false;
+}
+
+ModelMetadata
+TritonClient::get_model_metadata()
+{
+  for (const std::unique_ptr<Endpoint>& endpoint : endpoints_) {
+    bool is_ready = false;
+    ModelMetadata metadata;
+    tc::Error err;
+    if (protocol_ == Protocol::kGrpc) {
+      err = endpoint->grpc_client->IsModelReady(
+          &is_ready, model_name_, model_version_);
+      if (!err.IsOk() || !is_ready) {
+        continue;
+      }
+      inference::ModelMetadataResponse response;
+      err = endpoint->grpc_client->ModelMetadata(
+          &response, model_name_, model_version_);
+      auto append = [](const auto& tensors,
+                       std::vector<TensorMetadata>& target) {
+        for (const auto& tensor : tensors) {
+          target.push_back(
+              {tensor.name(), tensor.datatype(),
+               std::vector<int64_t>(
+                   tensor.shape().begin(), tensor.shape().end())});
+        }
+      };
+      if (err.IsOk()) {
+        metadata.versions.assign(
+            response.versions().begin(), response.versions().end());
+        append(response.inputs(), metadata.inputs);
+        append(response.outputs(), metadata.outputs);
+      }
+    } else {
+      err = endpoint->http_client->IsModelReady(
+          &is_ready, model_name_, model_version_);
+      if (!err.IsOk() || !is_ready) {
+        continue;
+      }
+      std::string json;
+      err = endpoint->http_client->ModelMetadata(
+          &json, model_name_, model_version_);
+      if (err.IsOk()) {
+        rapidjson::Document document;
+        document.Parse(json.c_str());
+        if (document.HasParseError() || !document.IsObject()) {
+          throw std::runtime_error(
+              "Failed to parse model metadata from " + endpoint->url + ".");
+        }
+        auto versions = document.FindMember("versions");
+        if (versions != document.MemberEnd() && versions->value.IsArray()) {
+          for (const rapidjson::Value& version : versions->value.GetArray()) {
+            if (version.IsString()) {
+              metadata.versions.push_back(version.GetString());
+            }
+          }
+        }
+        metadata.inputs = parse_tensors(document, "inputs");
+        metadata.outputs = parse_tensors(document, "outputs");
+      }
+    }
+    if (!err.IsOk()) {
+      throw std::runtime_error(
+          "Failed to get model metadata from " + endpoint->url + ": " +
+          err.Message());
+    }
+    return metadata;
+  }
+  throw std::runtime_error("Model " + model_name_ + " is not ready.");
+}
+
+void
+TritonClient::set_max_in_flight(int max_in_flight)
+{
+  std::lock_guard<std::mutex> lock(in_flight_mutex_);
+  max_in_flight_ = std::max(1, max_in_flight);
+  in_flight_monitor_.notify_all();
+}
+
+void
+TritonClient::set_routing(const RoutingOptions& routing)
+{
+  std::lock_guard<std::mutex> lock(endpoints_mutex_);
+  routing_ = routing;
+}
+
+void
+TritonClient::set_transport(const TransportOptions& transport)
+{
+  if (transport.mask_bits != 0 && transport.mask_bits != 1 &&
+      transport.mask_bits != 2 && transport.mask_bits != 4 &&
+      transport.mask_bits != 8) {
+    throw std::invalid_argument("Masks pack at 1, 2, 4 or 8 bits per pixel.");
   }
+  transport_ = transport;
+}
+
+void
+TritonClient::set_latency_listener(LatencyListener listener)
+{
+  latency_listener_ = std::move(listener);
+}
+
+void
+TritonClient::enable_shared_memory(
+    int num_regions, size_t input_size, size_t output_size)
+{
+  shared_memory_ = std::make_unique<SharedMemoryPool>(
+      num_regions, input_size, output_size);
 
-  // Prepare input tensor for image
+  for (const std::unique_ptr<Endpoint>& endpoint : endpoints_) {
+    for (const SharedMemoryPool::Region& region :
+         shared_memory_->get_regions()) {
+      size_t byte_size = region.input_size + region.output_size;
+      tc::Error err =
+          protocol_ == Protocol::kGrpc
+              ? endpoint->grpc_client->RegisterSystemSharedMemory(
+                    region.name, region.key, byte_size)
+              : endpoint->http_client->RegisterSystemSharedMemory(
+                    region.name, region.key, byte_size);
+      if (!err.IsOk()) {
+        throw std::runtime_error(
+            "Failed to register shared memory with " + endpoint->url + ": " +
+            err.Message());
+      }
+    }
+  }
+}
+
+std::shared_ptr<SharedMemoryPool::Region>
+TritonClient::acquire_shared_memory()
+{
+  if (!shared_memory_) {
+    return nullptr;
+  }
+  return shared_memory_->acquire();
+}
+
+TritonClient::RequestTensors
+TritonClient::create_tensors(
+    const std::vector<cv::Mat>& images, const std::string& output_name) const
+{
+  if (images.empty()) {
+    throw std::runtime_error("Error: No images to infer");
+  }
+  for (const cv::Mat& image : images) {
+    if (image.empty()) {
+      throw std::runtime_error("Error: Image is empty");
+    }
+    if (image.size() != images.front().size()) {
+      throw std::runtime_error("Error: Batched images differ in size");
+    }
+  }
+
+  // Prepare input tensor for the batch of images
+  const cv::Mat& first = images.front();
   std::vector<int64_t> input_shape = {
-      1, image.rows, image.cols, 3};  // NHWC format
-  std::vector<uint8_t> input_data(
-      image.data, image.data + (image.total() * image.elemSize()));
+      static_cast<int64_t>(images.size()), first.rows, first.cols,
+      3};  // NHWC format
+
+  // A single image read into a shared-memory region is passed by reference,
+  // and its mask comes back through the same region
+  RequestTensors tensors;
+  size_t image_size = first.total() * first.elemSize();
+  if (shared_memory_ && images.size() == 1 && first.isContinuous()) {
+    tensors.region = shared_memory_->find_input(first.data, image_size);
+  }
 
-  // Create input tensor
+  // Create input tensor, appending the images row by row so that views into
+  // larger buffers are sent without an intermediate copy
   std::shared_ptr<tc::InferInput> input_ptr;
   {
     tc::InferInput* input;
     tc::InferInput::Create(&input, "images", input_shape, "UINT8");
     input_ptr.reset(input);
-    input_ptr->AppendRaw(
-        reinterpret_cast<uint8_t*>(input_data.data()), input_data.size());
+  }
+  if (tensors.region) {
+    tc::Error err = input_ptr->SetSharedMemory(
+        tensors.region->name, image_size, first.data - tensors.region->address);
+    if (!err.IsOk()) {
+      throw std::runtime_error(
+          "Failed to set shared memory input: " + err.Message());
+    }
+  } else {
+    for (const cv::Mat& image : images) {
+      if (image.isContinuous()) {
+        input_ptr->AppendRaw(image.data, image.total() * image.elemSize());
+      } else {
+        for (int y = 0; y < image.rows; ++y) {
+          input_ptr->AppendRaw(image.ptr(y), image.cols * image.elemSize());
+        }
+      }
+    }
+  }
+  tensors.input = input_ptr;
+
+  // Only the requested output is sent back by the server. Masks come back
+  // through the shared-memory region when they fit it, and packed otherwise
+  // if packing is on.
+  tensors.is_output_shared = tensors.region && output_name == "masks" &&
+                             first.total() <= tensors.region->output_size;
+  bool is_packed = output_name == "masks" && !tensors.is_output_shared &&
+                   transport_.mask_bits > 0;
+  std::shared_ptr<tc::InferRequestedOutput> output_ptr;
+  {
+    tc::InferRequestedOutput* output;
+    tc::InferRequestedOutput::Create(
+        &output, is_packed ? "packed_masks" : output_name);
+    output_ptr.reset(output);
+  }
+  if (tensors.is_output_shared) {
+    tc::Error err = output_ptr->SetSharedMemory(
+        tensors.region->name, first.total(), tensors.region->input_size);
+    if (!err.IsOk()) {
+      throw std::runtime_error(
+          "Failed to set shared memory output: " + err.Message());
+    }
+  }
+  tensors.output = output_ptr;
+
+  return tensors;
+}
+
+std::shared_ptr<TritonClient::PendingRequest>
+TritonClient::create_request(
+    const std::vector<cv::Mat>& images, const std::string& output_name,
+    Completion done)
+{
+  {
+    std::lock_guard<std::mutex> lock(in_flight_mutex_);
+    live_requests_++;
+  }
+  std::shared_ptr<PendingRequest> request(
+      new PendingRequest, [this](PendingRequest* finished) {
+        delete finished;
+        std::lock_guard<std::mutex> lock(in_flight_mutex_);
+        live_requests_--;
+        in_flight_monitor_.notify_all();
+      });
+  request->images = images;
+  request->output_name = output_name;
+  request->done = std::move(done);
+  return request;
+}
+
+std::vector<cv::Mat>
+TritonClient::infer(
+    const std::vector<cv::Mat>& images, const std::string& output_name)
+{
+  // Masks view the response, which is freed once the completion returns
+  bool is_masks = output_name == "masks";
+  std::promise<std::vector<cv::Mat>> promise;
+  std::future<std::vector<cv::Mat>> future = promise.get_future();
+  send_attempt(
+      create_request(
+          images, output_name,
+          [&promise, is_masks](
+              std::vector<cv::Mat> outputs, std::exception_ptr error) {
+            if (error) {
+              promise.set_exception(error);
+              return;
+            }
+            if (is_masks) {
+              for (cv::Mat& output : outputs) {
+                output = output.clone();
+              }
+            }
+            promise.set_value(std::move(outputs));
+          }),
+      nullptr);
+  return future.get();
+}
+
+void
+TritonClient::infer_async(
+    const std::vector<cv::Mat>& images, const std::string& output_name,
+    Completion done)
+{
+  {
+    std::unique_lock<std::mutex> lock(in_flight_mutex_);
+    in_flight_monitor_.wait(
+        lock, [this] { return in_flight_ < max_in_flight_; });
+    in_flight_++;
+  }
+
+  std::shared_ptr<PendingRequest> request =
+      create_request(images, output_name, std::move(done));
+  request->holds_slot = true;
+  send_attempt(request, nullptr);
+}
+
+void
+TritonClient::send_attempt(
+    const std::shared_ptr<PendingRequest>& request, const Endpoint* avoid)
+{
+  RequestTensors tensors;
+  try {
+    tensors = create_tensors(request->images, request->output_name);
+  }
+  catch (...) {
+    {
+      std::lock_guard<std::mutex> lock(request->mutex);
+      if (request->is_finished) {
+        return;
+      }
+      request->is_finished = true;
+    }
+    finish_request(*request, {}, std::current_exception());
+    return;
+  }
+
+  Endpoint* endpoint = acquire_endpoint(avoid);
+  bool is_hedged;
+  {
+    std::lock_guard<std::mutex> lock(request->mutex);
+    request->attempts_in_flight++;
+    is_hedged = request->is_hedged;
   }
 
-  // Prepare inference options
   tc::InferOptions options(model_name_);
   options.model_version_ = model_version_;
+  options.client_timeout_ = get_attempt_timeout().count();
 
-  // Make inference request
-  std::shared_ptr<tc::InferResult> result_ptr;
-  tc::Error err;
-  int attempts = 0;
-  do {
-    tc::InferResult* result;
-    std::vector<const tc::InferRequestedOutput*> outputs;
-    err = client_->Infer(&result, options, {input_ptr.get()}, outputs, {});
-    if (err.IsOk()) {
-      result_ptr.reset(result);
-      break;
-    }
-    std::cerr << "Error: " << err << std::endl;
-    std::cerr << "Sleeping for " << retry_interval_
-              << " seconds and retrying. [Attempt: " << attempts + 1 << "/"
-              << max_retries_ << "]" << std::endl;
-    std::this_thread::sleep_for(std::chrono::seconds(retry_interval_));
-  } while (++attempts < max_retries_);
+  // Inputs in shared memory do not cross the socket
+  if (!tensors.region) {
+    const cv::Mat& first = request->images.front();
+    utility::Metrics::get().add(
+        "dispatcher_triton_input_bytes_total",
+        "Input tensor bytes sent to Triton on the wire, compressed sizes "
+        "extrapolated from samples",
+        get_wire_bytes(
+            "input", transport_.request_compression, first,
+            static_cast<double>(first.total() * first.elemSize()) *
+                request->images.size()));
+  }
+
+  // The request, holding the images, and the tensors must outlive the
+  // attempt, so the callback holds on to them
+  auto sent_at = std::chrono::steady_clock::now();
+  tc::Error err = async_infer_once(
+      *endpoint,
+      [this, request, endpoint, tensors, sent_at](
+          tc::InferResult* result, const tc::Error& err) {
+        on_attempt_result(
+            request, endpoint, tensors, sent_at,
+            std::shared_ptr<tc::InferResult>(result), err);
+      },
+      options, {tensors.input.get()}, {tensors.output.get()});
   if (!err.IsOk()) {
-    throw std::runtime_error("Inference failed: " + err.Message());
+    on_attempt_result(request, endpoint, tensors, sent_at, nullptr, err);
+    return;
   }
 
-  return get_mask(result_ptr, image.rows, image.cols);
+  // Hedging would have two servers write the same shared-memory mask
+  double threshold_ms = get_hedge_threshold_ms();
+  if (threshold_ms > 0 && !is_hedged && !tensors.is_output_shared) {
+    timer_->schedule(
+        std::chrono::microseconds(static_cast<int64_t>(threshold_ms * 1000)),
+        [this, request, endpoint]() { hedge_request(request, endpoint); });
+  }
 }
 
-cv::Mat
-TritonClient::get_mask(
-    const std::shared_ptr<tc::InferResult>& result, int rows, int cols) const
+void
+TritonClient::on_attempt_result(
+    const std::shared_ptr<PendingRequest>& request, Endpoint* endpoint,
+    const RequestTensors& tensors,
+    std::chrono::steady_clock::time_point sent_at,
+    std::shared_ptr<tc::InferResult> result, const tc::Error& err)
+{
+  std::chrono::steady_clock::duration round_trip =
+      std::chrono::steady_clock::now() - sent_at;
+  release_endpoint(
+      endpoint, err.IsOk(),
+      std::chrono::duration<double, std::milli>(round_trip).count());
+  if (err.IsOk() && latency_listener_) {
+    latency_listener_(round_trip);
+  }
+
+  int retry = 0;
+  {
+    std::lock_guard<std::mutex> lock(request->mutex);
+    request->attempts_in_flight--;
+    if (request->is_finished) {
+      return;  // Another attempt answered first
+    }
+    if (!err.IsOk() && request->attempts_in_flight > 0) {
+      return;  // A hedge may still answer
+    }
+    if (!err.IsOk() && request->retries + 1 < max_retries_) {
+      retry = ++request->retries;
+    } else {
+      request->is_finished = true;
+    }
+  }
+
+  if (err.IsOk()) {
+    std::vector<cv::Mat> outputs;
+    try {
+      outputs = get_outputs(result, request->images, tensors);
+    }
+    catch (...) {
+      finish_request(*request, {}, std::current_exception());
+      return;
+    }
+    finish_request(*request, std::move(outputs), nullptr);
+    return;
+  }
+  if (retry == 0) {
+    finish_request(
+        *request, {},
+        std::make_exception_ptr(
+            std::runtime_error("Inference failed: " + err.Message())));
+    return;
+  }
+
+  // Back off on the timer thread, not on the completion thread, and try
+  // another endpoint if there is one
+  std::chrono::milliseconds backoff = get_backoff(retry);
+  std::cerr << "Error from " << endpoint->url << ": " << err << std::endl;
+  std::cerr << "Retrying in " << backoff.count() << " ms. [Attempt: " << retry
+            << "/" << max_retries_ << "]" << std::endl;
+  timer_->schedule(backoff, [this, request, endpoint]() {
+    send_attempt(request, endpoint);
+  });
+}
+
+void
+TritonClient::finish_request(
+    PendingRequest& request, std::vector<cv::Mat> outputs,
+    std::exception_ptr error)
+{
+  request.done(std::move(outputs), error);
+
+  if (request.holds_slot) {
+    std::lock_guard<std::mutex> lock(in_flight_mutex_);
+    in_flight_--;
+    in_flight_monitor_.notify_all();
+  }
+}
+
+void
+TritonClient::hedge_request(
+    const std::shared_ptr<PendingRequest>& request, const Endpoint* first)
+{
+  {
+    std::lock_guard<std::mutex> lock(request->mutex);
+    if (request->is_finished || request->is_hedged ||
+        request->attempts_in_flight == 0) {
+      return;
+    }
+    request->is_hedged = true;
+  }
+  if (verbose_) {
+    std::cout << "Hedging a request sent to " << first->url << std::endl;
+  }
+  send_attempt(request, first);
+}
+
+TritonClient::Endpoint*
+TritonClient::acquire_endpoint(const Endpoint* avoid)
+{
+  std::lock_guard<std::mutex> lock(endpoints_mutex_);
+  auto now = std::chrono::steady_clock::now();
+
+  auto is_better = [this](const Endpoint* a, const Endpoint* b) {
+    if (routing_.balancing == Balancing::kLatency) {
+      return (a->outstanding + 1) * a->latency_ms <
+             (b->outstanding + 1) * b->latency_ms;
+    }
+    return a->outstanding < b->outstanding ||
+           (a->outstanding == b->outstanding && a->latency_ms < b->latency_ms);
+  };
+
+  // An open circuit turns half open once its time is up, letting a single
+  // trial attempt through
+  auto pick = [&](bool allow_avoid) {
+    Endpoint* best = nullptr;
+    for (const std::unique_ptr<Endpoint>& endpoint : endpoints_) {
+      Endpoint* candidate = endpoint.get();
+      if (candidate == avoid && !allow_avoid) {
+        continue;
+      }
+      if (candidate->consecutive_failures >= CIRCUIT_FAILURE_THRESHOLD &&
+          (candidate->open_until > now || candidate->outstanding > 0)) {
+        continue;
+      }
+      if (!best || is_better(candidate, best)) {
+        best = candidate;
+      }
+    }
+    return best;
+  };
+
+  Endpoint* chosen = pick(false);
+  if (!chosen) {
+    chosen = pick(true);
+  }
+
+  // With every circuit open, the one closing first gets the attempt
+  if (!chosen) {
+    for (const std::unique_ptr<Endpoint>& endpoint : endpoints_) {
+      if (!chosen || endpoint->open_until < chosen->open_until) {
+        chosen = endpoint.get();
+      }
+    }
+  }
+
+  chosen->outstanding++;
+  return chosen;
+}
+
+void
+TritonClient::release_endpoint(
+    Endpoint* endpoint, bool is_ok, double latency_ms)
+{
+  std::lock_guard<std::mutex> lock(endpoints_mutex_);
+  endpoint->outstanding--;
+
+  if (!is_ok) {
+    // Open the circuit, for longer each time a trial attempt fails again
+    int excess = ++endpoint->consecutive_failures - CIRCUIT_FAILURE_THRESHOLD;
+    if (excess >= 0) {
+      int open_ms =
+          std::min(CIRCUIT_MAX_OPEN_MS, CIRCUIT_OPEN_MS << std::min(excess, 5));
+      endpoint->open_until =
+          std::chrono::steady_clock::now() + std::chrono::milliseconds(open_ms);
+      std::cerr << "Warning: Circuit of " << endpoint->url << " open for "
+                << open_ms << " ms" << std::endl;
+    }
+    return;
+  }
+
+  endpoint->consecutive_failures = 0;
+  endpoint->latency_ms =
+      endpoint->latency_ms == 0
+          ? latency_ms
+          : LATENCY_SMOOTHING * latency_ms +
+                (1 - LATENCY_SMOOTHING) * endpoint->latency_ms;
+
+  if (latency_samples_.size() < LATENCY_SAMPLES) {
+    latency_samples_.push_back(latency_ms);
+  } else {
+    latency_samples_[next_latency_sample_ % LATENCY_SAMPLES] = latency_ms;
+  }
+  next_latency_sample_++;
+
+  // The percentile moves slowly, so it is only taken every so often
+  if (routing_.hedge_percentile > 0 &&
+      latency_samples_.size() >= MIN_LATENCY_SAMPLES &&
+      next_latency_sample_ % HEDGE_THRESHOLD_PERIOD == 0) {
+    hedge_samples_ = latency_samples_;
+    size_t rank = std::min(
+        hedge_samples_.size() - 1,
+        static_cast<size_t>(
+            routing_.hedge_percentile / 100 * hedge_samples_.size()));
+    std::nth_element(
+        hedge_samples_.begin(), hedge_samples_.begin() + rank,
+        hedge_samples_.end());
+    hedge_threshold_ms_ = hedge_samples_[rank];
+  }
+}
+
+double
+TritonClient::get_hedge_threshold_ms()
+{
+  std::lock_guard<std::mutex> lock(endpoints_mutex_);
+  return routing_.hedge_percentile > 0 ? hedge_threshold_ms_ : 0;
+}
+
+std::chrono::microseconds
+TritonClient::get_attempt_timeout()
+{
+  std::lock_guard<std::mutex> lock(endpoints_mutex_);
+  return std::chrono::milliseconds(std::max(0, routing_.attempt_timeout_ms));
+}
+
+std::chrono::milliseconds
+TritonClient::get_backoff(int retry) const
+{
+  // Full jitter, uniform up to a cap growing exponentially with the retries
+  thread_local std::mt19937 generator(std::random_device{}());
+  int64_t cap = std::min<int64_t>(
+      static_cast<int64_t>(retry_interval_) * 1000,
+      static_cast<int64_t>(BACKOFF_BASE_MS) << std::min(retry - 1, 20));
+  std::uniform_int_distribution<int64_t> distribution(0, cap);
+  return std::chrono::milliseconds(distribution(generator));
+}
+
+tc::Error
+TritonClient::async_infer_once(
+    Endpoint& endpoint, AttemptCompletion callback, tc::InferOptions options,
+    const std::vector<tc::InferInput*>& inputs,
+    const std::vector<const tc::InferRequestedOutput*>& outputs)
+{
+  if (protocol_ == Protocol::kHttp) {
+    return endpoint.http_client->AsyncInfer(
+        [callback](tc::InferResult* result) {
+          callback(result, result->RequestStatus());
+        },
+        options, inputs, outputs, tc::Headers(), tc::Parameters(),
+        get_http_compression(transport_.request_compression),
+        get_http_compression(transport_.response_compression));
+  }
+
+  // Requests share one stream per endpoint, whose results are told apart by
+  // request id
+  std::unique_lock<std::mutex> stream_lock(endpoint.stream_mutex);
+  bool is_stream_failed;
+  {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    is_stream_failed = endpoint.is_stream_failed;
+  }
+  if (is_stream_failed) {
+    // Joins the reader thread of the failed stream before starting anew
+    endpoint.grpc_client->StopStream();
+    endpoint.is_stream_started = false;
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    endpoint.is_stream_failed = false;
+  }
+  if (!endpoint.is_stream_started) {
+    tc::Error err = endpoint.grpc_client->StartStream(
+        [this, &endpoint](tc::InferResult* result) {
+          on_stream_result(endpoint, result);
+        },
+        true, 0, tc::Headers(),
+        get_grpc_compression(transport_.request_compression));
+    if (!err.IsOk()) {
+      return err;
+    }
+    endpoint.is_stream_started = true;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    options.request_id_ = std::to_string(next_request_id_++);
+    endpoint.stream_completions[options.request_id_] = std::move(callback);
+  }
+  tc::Error err =
+      endpoint.grpc_client->AsyncStreamInfer(options, inputs, outputs);
+  if (err.IsOk()) {
+    // Requests on a stream ignore the client timeout, so they expire here
+    if (options.client_timeout_ > 0) {
+      std::string request_id = options.request_id_;
+      timer_->schedule(
+          std::chrono::microseconds(options.client_timeout_),
+          [this, &endpoint, request_id]() {
+            expire_stream_request(endpoint, request_id);
+          });
+    }
+    return err;
+  }
+
+  // A failed write means a broken stream. When the stream already failed the
+  // request, its completion ran and the attempt must not fail twice.
+  bool is_pending;
+  {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    is_pending = endpoint.stream_completions.erase(options.request_id_) > 0;
+  }
+  stream_lock.unlock();
+  fail_stream(endpoint, err);
+  return is_pending ? err : tc::Error::Success;
+}
+
+void
+TritonClient::on_stream_result(Endpoint& endpoint, tc::InferResult* result)
+{
+  std::string request_id;
+  result->Id(&request_id);
+
+  AttemptCompletion callback;
+  {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    auto it = endpoint.stream_completions.find(request_id);
+    if (it != endpoint.stream_completions.end()) {
+      callback = std::move(it->second);
+      endpoint.stream_completions.erase(it);
+    }
+  }
+
+  // The completion takes ownership of the result
+  if (callback) {
+    callback(result, result->RequestStatus());
+    return;
+  }
+
+  // An error belonging to no request reports the end of the stream
+  tc::Error err = result->RequestStatus();
+  delete result;
+  if (err.IsOk()) {
+    std::cerr << "Warning: Dropping result of unknown or expired request "
+              << request_id << std::endl;
+    return;
+  }
+  fail_stream(endpoint, err);
+}
+
+void
+TritonClient::fail_stream(Endpoint& endpoint, const tc::Error& err)
+{
+  std::map<std::string, AttemptCompletion> completions;
+  {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    endpoint.is_stream_failed = true;
+    completions.swap(endpoint.stream_completions);
+  }
+  std::cerr << "Warning: gRPC stream to " << endpoint.url
+            << " failed: " << err.Message() << std::endl;
+
+  // Each failure counts with the circuit breaker and retries the request
+  for (auto& completion : completions) {
+    completion.second(nullptr, err);
+  }
+}
+
+void
+TritonClient::expire_stream_request(
+    Endpoint& endpoint, const std::string& request_id)
+{
+  AttemptCompletion callback;
+  {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    auto it = endpoint.stream_completions.find(request_id);
+    if (it == endpoint.stream_completions.end()) {
+      return;  // Answered in time
+    }
+    callback = std::move(it->second);
+    endpoint.stream_completions.erase(it);
+  }
+  callback(nullptr, tc::Error("Deadline Exceeded"));
+}
+
+std::vector<cv::Mat>
+TritonClient::get_outputs(
+    const std::shared_ptr<tc::InferResult>& result,
+    const std::vector<cv::Mat>& images, const RequestTensors& tensors) const
+{
+  if (tensors.is_output_shared) {
+    const cv::Mat& image = images.front();
+    return {cv::Mat(
+        image.rows, image.cols, CV_8UC1,
+        tensors.region->address + tensors.region->input_size)};
+  }
+  if (tensors.output->Name() == "probabilities") {
+    return get_probabilities(result, images.size());
+  }
+  if (tensors.output->Name() == "packed_masks") {
+    return get_packed_masks(result, images);
+  }
+  return get_masks(result, images);
+}
+
+void
+TritonClient::count_output_bytes(
+    const std::string& output, const uint8_t* data, size_t size) const
+{
+  // Over gRPC the server picks the compression of its responses, which is
+  // none unless it was configured otherwise
+  Compression compression = protocol_ == Protocol::kHttp
+                                ? transport_.response_compression
+                                : Compression::kNone;
+  cv::Mat sample(
+      1, static_cast<int>(size), CV_8UC1, const_cast<uint8_t*>(data));
+  utility::Metrics::get().add(
+      "dispatcher_triton_output_bytes_total{output=\"" + output + "\"}",
+      "Output tensor bytes received from Triton on the wire, compressed sizes "
+      "extrapolated from samples",
+      get_wire_bytes(output, compression, sample, size));
+}
+
+std::vector<cv::Mat>
+TritonClient::get_masks(
+    const std::shared_ptr<tc::InferResult>& result,
+    const std::vector<cv::Mat>& images) const
 {
   size_t output_byte_size;
   const uint8_t* mask_data;
@@ -99,15 +1176,112 @@ TritonClient::get_mask(
   }
 
   // Validate the size of the mask data
-  if (output_byte_size != static_cast<size_t>(rows * cols)) {
+  size_t mask_size = images.front().total();
+  if (output_byte_size != mask_size * images.size()) {
     throw std::runtime_error("Mask size does not match expected dimensions.");
   }
 
-  // Create a cv::Mat from the raw mask data
-  cv::Mat mask(rows, cols, CV_8UC1);
-  std::memcpy(mask.data, mask_data, output_byte_size);
+  count_output_bytes("masks", mask_data, output_byte_size);
+
+  // View each image's mask in the raw mask data, without a copy
+  std::vector<cv::Mat> masks;
+  for (size_t i = 0; i < images.size(); ++i) {
+    masks.emplace_back(
+        images[i].rows, images[i].cols, CV_8UC1,
+        const_cast<uint8_t*>(mask_data + i * mask_size));
+  }
+
+  return masks;
+}
+
+std::vector<cv::Mat>
+TritonClient::get_packed_masks(
+    const std::shared_ptr<tc::InferResult>& result,
+    const std::vector<cv::Mat>& images) const
+{
+  size_t output_byte_size;
+  const uint8_t* packed_data;
+  tc::Error err =
+      result->RawData("packed_masks", &packed_data, &output_byte_size);
+  if (!err.IsOk()) {
+    throw std::runtime_error(
+        "Failed to retrieve packed masks: " + err.Message());
+  }
+
+  // Each mask is packed row-major, each byte's first pixel in its lowest bits
+  int bits = transport_.mask_bits;
+  int pixels_per_byte = 8 / bits;
+  uint8_t label_mask = static_cast<uint8_t>((1 << bits) - 1);
+  size_t mask_size = images.front().total();
+  size_t packed_size = (mask_size + pixels_per_byte - 1) / pixels_per_byte;
+  if (output_byte_size != packed_size * images.size()) {
+    throw std::runtime_error(
+        "Packed mask size does not match expected dimensions.");
+  }
+  count_output_bytes("packed_masks", packed_data, output_byte_size);
+
+  std::vector<cv::Mat> masks;
+  for (size_t i = 0; i < images.size(); ++i) {
+    cv::Mat mask(images[i].rows, images[i].cols, CV_8UC1);
+    const uint8_t* packed = packed_data + i * packed_size;
+    uint8_t* labels = mask.data;
+    for (size_t pixel = 0; pixel < mask_size; pixel += pixels_per_byte) {
+      uint8_t byte = *packed++;
+      size_t end = std::min(mask_size, pixel + pixels_per_byte);
+      for (size_t p = pixel; p < end; ++p) {
+        labels[p] = byte & label_mask;
+        byte >>= bits;
+      }
+    }
+    masks.push_back(mask);
+  }
+
+  return masks;
+}
+
+std::vector<cv::Mat>
+TritonClient::get_probabilities(
+    const std::shared_ptr<tc::InferResult>& result, size_t count) const
+{
+  std::vector<int64_t> shape;
+  tc::Error err = result->Shape("probabilities", &shape);
+  if (!err.IsOk()) {
+    throw std::runtime_error(
+        "Failed to retrieve probabilities: " + err.Message());
+  }
+
+  // Batch of (H/4, W/4, C) half-precision tensors
+  if (shape.size() != 4 || shape[0] != static_cast<int64_t>(count)) {
+    throw std::runtime_error("Unexpected probabilities shape.");
+  }
+  int rows = shape[1], cols = shape[2], num_classes = shape[3];
+
+  size_t output_byte_size;
+  const uint8_t* probability_data;
+  err = result->RawData("probabilities", &probability_data, &output_byte_size);
+  if (!err.IsOk()) {
+    throw std::runtime_error(
+        "Failed to retrieve probabilities: " + err.Message());
+  }
+  size_t item_size =
+      static_cast<size_t>(rows) * cols * num_classes * sizeof(uint16_t);
+  if (output_byte_size != item_size * count) {
+    throw std::runtime_error(
+        "Probabilities size does not match expected dimensions.");
+  }
+
+  count_output_bytes("probabilities", probability_data, output_byte_size);
+
+  // Widen to single precision, which also copies out of the result buffer
+  std::vector<cv::Mat> probabilities(count);
+  for (size_t i = 0; i < count; ++i) {
+    cv::Mat half(
+        rows, cols, CV_16FC(num_classes),
+        const_cast<uint8_t*>(probability_data + i * item_size));
+    half.convertTo(probabilities[i], CV_32F);
+  }
 
-  return mask;
+  return probabilities;
 }
 
 }  // namespace client
@@ -0,0 +1,177 @@
+#include "vote_accumulator.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace scene {
+
+// Rows guarded by each stripe mutex
+const int ROWS_PER_STRIPE = 16;
+
+VoteAccumulator::VoteAccumulator(
+    int width, int height, int num_classes, int max_votes, int column_width)
+    : width_(width), height_(height), num_classes_(num_classes),
+      column_width_(column_width > 0 ? std::min(column_width, width) : width),
+      num_columns_(column_width_ > 0 ? (width + column_width_ - 1) /
+                                           column_width_
+                                     : 0),
+      kernel_(get_vote_kernel(num_classes, max_votes)), resident_segments_(0),
+      stripe_mutexes_((height + ROWS_PER_STRIPE - 1) / ROWS_PER_STRIPE)
+{
+  if (width <= 0 || height <= 0 || num_classes <= 0) {
+    throw std::runtime_error("Invalid dimensions for vote accumulator.");
+  }
+  size_t num_segments = static_cast<size_t>(height_) * num_columns_;
+  pending_patches_.assign(num_segments, 0);
+  is_final_.assign(num_segments, 0);
+  segment_counts_.resize(num_segments);
+}
+
+void
+VoteAccumulator::expect_patch(const cv::Rect& roi)
+{
+  cv::Range columns = get_columns(roi.x, roi.width);
+  for (int y = std::max(roi.y, 0); y < std::min(roi.y + roi.height, height_);
+       ++y) {
+    for (int column = columns.start; column < columns.end; ++column) {
+      pending_patches_[static_cast<size_t>(y) * num_columns_ + column]++;
+    }
+  }
+}
+
+std::vector<cv::Rect>
+VoteAccumulator::add_votes(const cv::Rect& roi, const cv::Mat& patch)
+{
+  std::vector<cv::Rect> final_regions;
+  cv::Range columns = get_columns(roi.x, roi.width);
+
+  // Index in final_regions of the region each column last grew, so that
+  // segments becoming final on consecutive rows are merged
+  std::vector<int> open_regions(columns.size(), -1);
+
+  for (int y = 0; y < roi.height; ++y) {
+    int row = roi.y + y;
+
+    // Rows are independent, so only the current row's stripe is held
+    std::lock_guard<std::mutex> lock(get_stripe_mutex(row));
+    for (int column = columns.start; column < columns.end; ++column) {
+      size_t segment = static_cast<size_t>(row) * num_columns_ + column;
+      if (is_final_[segment]) {
+        continue;  // Already written, late votes cannot change it anymore
+      }
+
+      cv::Range span = get_column_span(column);
+      std::vector<uint8_t>& counts = segment_counts_[segment];
+      if (counts.empty()) {
+        counts.assign(
+            static_cast<size_t>(span.size()) * num_classes_ *
+                kernel_.counter_size,
+            0);
+        resident_segments_++;
+      }
+
+      int start = std::max(roi.x, span.start);
+      int end = std::min(roi.x + roi.width, span.end);
+      kernel_.add_votes(
+          patch.ptr<uint8_t>(y) + (start - roi.x), counts.data(),
+          start - span.start, end - start, span.size(), num_classes_);
+
+      if (--pending_patches_[segment] > 0) {
+        continue;
+      }
+      int& open = open_regions[column - columns.start];
+      if (open >= 0 &&
+          final_regions[open].y + final_regions[open].height == row) {
+        final_regions[open].height++;
+      } else {
+        open = final_regions.size();
+        final_regions.push_back(cv::Rect(span.start, row, span.size(), 1));
+      }
+    }
+  }
+
+  return final_regions;
+}
+
+std::vector<cv::Rect>
+VoteAccumulator::get_pending_regions() const
+{
+  std::vector<cv::Rect> pending_regions;
+  for (int column = 0; column < num_columns_; ++column) {
+    cv::Range span = get_column_span(column);
+    bool is_open = false;
+    for (int row = 0; row < height_; ++row) {
+      std::lock_guard<std::mutex> lock(get_stripe_mutex(row));
+      if (is_final_[static_cast<size_t>(row) * num_columns_ + column]) {
+        is_open = false;
+        continue;
+      }
+      if (is_open) {
+        pending_regions.back().height++;
+      } else {
+        pending_regions.push_back(cv::Rect(span.start, row, span.size(), 1));
+        is_open = true;
+      }
+    }
+  }
+  return pending_regions;
+}
+
+void
+VoteAccumulator::take_labels(const cv::Rect& region, uint8_t* labels)
+{
+  int column = region.x / column_width_;
+  if (region.width != get_column_span(column).size() ||
+      region.x != get_column_span(column).start) {
+    throw std::runtime_error("Region does not span one vote column.");
+  }
+
+  for (int row = region.y; row < region.y + region.height; ++row) {
+    std::lock_guard<std::mutex> lock(get_stripe_mutex(row));
+    size_t segment = static_cast<size_t>(row) * num_columns_ + column;
+    uint8_t* row_labels =
+        labels + static_cast<size_t>(row - region.y) * region.width;
+    std::vector<uint8_t>& counts = segment_counts_[segment];
+
+    if (counts.empty()) {
+      std::fill(row_labels, row_labels + region.width, 0);
+    } else {
+      kernel_.argmax(counts.data(), row_labels, region.width, num_classes_);
+      std::vector<uint8_t>().swap(counts);
+      resident_segments_--;
+    }
+    is_final_[segment] = 1;
+  }
+}
+
+std::mutex&
+VoteAccumulator::get_stripe_mutex(int row) const
+{
+  return stripe_mutexes_[row / ROWS_PER_STRIPE];
+}
+
+cv::Range
+VoteAccumulator::get_columns(int x, int width) const
+{
+  int start = std::max(x, 0);
+  int end = std::min(x + width, width_);
+  if (start >= end) {
+    return cv::Range(0, 0);
+  }
+  return cv::Range(start / column_width_, (end - 1) / column_width_ + 1);
+}
+
+cv::Range
+VoteAccumulator::get_column_span(int column) const
+{
+  return cv::Range(
+      column * column_width_, std::min((column + 1) * column_width_, width_));
+}
+
+int
+VoteAccumulator::get_resident_segments() const
+{
+  return resident_segments_;
+}
+
+}  // namespace scene
@@ -0,0 +1,178 @@
+#include "vote_kernels.h"
+
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace scene {
+
+namespace {
+
+// N is the class count when known at compile time, 0 for the generic kernel
+template <typename T, int N>
+void
+add_votes(
+    const uint8_t* labels, void* counts, int offset, int count, int width,
+    int num_classes)
+{
+  const int classes = N > 0 ? N : num_classes;
+  T* planes = static_cast<T*>(counts) + offset;
+  int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 16 <= count; i += 16) {
+    __m128i label_bytes =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(labels + i));
+    if (std::is_same<T, uint8_t>::value) {
+      const __m128i one = _mm_set1_epi8(1);
+      for (int c = 0; c < classes; ++c) {
+        __m128i* plane = reinterpret_cast<__m128i*>(
+            planes + static_cast<size_t>(c) * width + i);
+        __m128i hit = _mm_and_si128(
+            _mm_cmpeq_epi8(label_bytes, _mm_set1_epi8(static_cast<char>(c))),
+            one);
+        _mm_storeu_si128(plane, _mm_adds_epu8(_mm_loadu_si128(plane), hit));
+      }
+    } else {
+      const __m128i one = _mm_set1_epi16(1);
+      __m128i low = _mm_unpacklo_epi8(label_bytes, zero);
+      __m128i high = _mm_unpackhi_epi8(label_bytes, zero);
+      for (int c = 0; c < classes; ++c) {
+        __m128i* plane = reinterpret_cast<__m128i*>(
+            planes + static_cast<size_t>(c) * width + i);
+        __m128i label = _mm_set1_epi16(static_cast<short>(c));
+        __m128i low_hit = _mm_and_si128(_mm_cmpeq_epi16(low, label), one);
+        __m128i high_hit = _mm_and_si128(_mm_cmpeq_epi16(high, label), one);
+        _mm_storeu_si128(
+            plane, _mm_adds_epu16(_mm_loadu_si128(plane), low_hit));
+        _mm_storeu_si128(
+            plane + 1, _mm_adds_epu16(_mm_loadu_si128(plane + 1), high_hit));
+      }
+    }
+  }
+#endif
+
+  for (; i < count; ++i) {
+    int class_label = labels[i];
+    if (class_label >= classes) {
+      continue;
+    }
+    T& counter = planes[static_cast<size_t>(class_label) * width + i];
+    if (counter < std::numeric_limits<T>::max()) {
+      counter++;
+    }
+  }
+}
+
+template <typename T, int N>
+void
+argmax(const void* counts, uint8_t* labels, int width, int num_classes)
+{
+  const int classes = N > 0 ? N : num_classes;
+  const T* planes = static_cast<const T*>(counts);
+  int i = 0;
+
+#if defined(__SSE2__)
+  for (; i + 16 <= width; i += 16) {
+    if (std::is_same<T, uint8_t>::value) {
+      const __m128i* plane = reinterpret_cast<const __m128i*>(planes + i);
+      __m128i best = _mm_loadu_si128(plane);
+      __m128i best_class = _mm_setzero_si128();
+      for (int c = 1; c < classes; ++c) {
+        __m128i votes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+            planes + static_cast<size_t>(c) * width + i));
+        // Unsigned votes > best, as not (max(votes, best) == best)
+        __m128i not_greater =
+            _mm_cmpeq_epi8(_mm_max_epu8(votes, best), best);
+        best = _mm_max_epu8(votes, best);
+        best_class = _mm_or_si128(
+            _mm_and_si128(not_greater, best_class),
+            _mm_andnot_si128(
+                not_greater, _mm_set1_epi8(static_cast<char>(c))));
+      }
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(labels + i), best_class);
+    } else {
+      // Two halves of 8 pixels; 16-bit counters stay far below the signed
+      // limit, see get_vote_kernel
+      __m128i halves[2];
+      for (int h = 0; h < 2; ++h) {
+        const T* base = planes + i + 8 * h;
+        __m128i best = _mm_loadu_si128(reinterpret_cast<const __m128i*>(base));
+        __m128i best_class = _mm_setzero_si128();
+        for (int c = 1; c < classes; ++c) {
+          __m128i votes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+              base + static_cast<size_t>(c) * width));
+          __m128i greater = _mm_cmpgt_epi16(votes, best);
+          best = _mm_max_epi16(votes, best);
+          best_class = _mm_or_si128(
+              _mm_andnot_si128(greater, best_class),
+              _mm_and_si128(greater, _mm_set1_epi16(static_cast<short>(c))));
+        }
+        halves[h] = best_class;
+      }
+      _mm_storeu_si128(
+          reinterpret_cast<__m128i*>(labels + i),
+          _mm_packus_epi16(halves[0], halves[1]));
+    }
+  }
+#endif
+
+  for (; i < width; ++i) {
+    T best = planes[i];
+    uint8_t best_class = 0;
+    for (int c = 1; c < classes; ++c) {
+      T votes = planes[static_cast<size_t>(c) * width + i];
+      if (votes > best) {
+        best = votes;
+        best_class = static_cast<uint8_t>(c);
+      }
+    }
+    labels[i] = best_class;
+  }
+}
+
+template <typename T>
+VoteKernel
+get_kernel_for_counter(int num_classes)
+{
+  switch (num_classes) {
+    case 2:
+      return {add_votes<T, 2>, argmax<T, 2>, sizeof(T)};
+    case 3:
+      return {add_votes<T, 3>, argmax<T, 3>, sizeof(T)};
+    case 4:
+      return {add_votes<T, 4>, argmax<T, 4>, sizeof(T)};
+    case 8:
+      return {add_votes<T, 8>, argmax<T, 8>, sizeof(T)};
+    default:
+      return {add_votes<T, 0>, argmax<T, 0>, sizeof(T)};
+  }
+}
+
+}  // namespace
+
+VoteKernel
+get_vote_kernel(int num_classes, int max_votes)
+{
+  if (num_classes <= 0 || num_classes > 256) {
+    throw std::runtime_error("Unsupported number of classes.");
+  }
+
+  if (max_votes <= std::numeric_limits<uint8_t>::max()) {
+    return get_kernel_for_counter<uint8_t>(num_classes);
+  }
+
+  // Counters saturate instead of wrapping, and the 16-bit argmax compares
+  // them as signed, so stay within the signed range
+  if (max_votes > std::numeric_limits<int16_t>::max()) {
+    throw std::runtime_error("Too many overlapping patches per pixel.");
+  }
+  return get_kernel_for_counter<uint16_t>(num_classes);
+}
+
+}  // namespace scene
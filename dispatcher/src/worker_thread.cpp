@@ -1,6 +1,5 @@
 #include "worker_thread.h"
 
-#include <iostream>
 #include <stdexcept>
 
 namespace utility {
@@ -89,11 +88,9 @@ WorkerThread::thread_loop()
           lock, [this] { return want_stop_ || !task_queue_.empty(); });
 
       if (want_stop_ && task_queue_.empty()) {
-        std::cout << "Thread is stopping..." << std::endl;
         return;
       }
 
-      std::cout << "Thread woke up and got a task" << std::endl;
       task = std::move(task_queue_.front());
       task_queue_.pop();
     }
@@ -101,11 +98,9 @@ WorkerThread::thread_loop()
     try {
       task.first();             // Execute the task
       task.second.set_value();  // Set the promise as completed
-      std::cout << "Task executed successfully" << std::endl;
     }
     catch (...) {
       task.second.set_exception(std::current_exception());  // Handle exceptions
-      std::cout << "Exception occurred while executing task" << std::endl;
     }
   }
 }
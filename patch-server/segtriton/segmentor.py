@@ -21,20 +21,23 @@ class Segmenter:
         self.device = device
 
     @torch.no_grad()
-    def predict(self, image: Image) -> Tuple[torch.Tensor]:
+    def predict(self, image: Image, with_mask: bool = True) -> Tuple[torch.Tensor]:
         """
         Generate masks and return masks.
 
         Args:
             image: Input image
+            with_mask: Whether to upsample the logits to a mask
 
         Returns:
             logits: Logits tensor (height/4, width/4, num_labels)
-            masks: Mask tensor (height, width)
+            masks: Mask tensor (height, width), or None without with_mask
         """
 
         inputs = self.processor(images=image, return_tensors="pt").to(self.device)
         outputs = self.model(**inputs)
+        if not with_mask:
+            return outputs.logits[0], None
         return (
             outputs.logits[0],
             self.processor.post_process_semantic_segmentation(
@@ -3,13 +3,15 @@ import logging
 from typing import Dict, List, Optional
 
 import numpy as np
-import pytriton.decorators as decorators
 import torch
 from PIL import Image
 from pytriton.model_config import DynamicBatcher, ModelConfig, Tensor
+from pytriton.proxy.types import Request
 from pytriton.triton import Triton
 from segtriton.segmenter import Segmenter
 
+OUTPUT_NAMES = ("masks", "packed_masks", "probabilities")
+
 
 class _InferCallable:
     def __init__(
@@ -19,21 +21,71 @@ class _InferCallable:
         cache_dir: str,
     ):
         self.model = Segmenter(model_id, device, cache_dir)
+        self.num_classes = self.model.model.config.num_labels
         logging.info(f"Model loaded on {device}.")
         logging.info(f"Model ID: {model_id}")
 
-    @decorators.batch
-    def __call__(self, images: np.ndarray) -> Dict[str, np.ndarray]:
-        processed_images = [Image.fromarray(img) for img in images]
+    def __call__(self, requests: List[Request]) -> List[Dict[str, np.ndarray]]:
+        return [self._infer(request) for request in requests]
+
+    def _infer(self, request: Request) -> Dict[str, np.ndarray]:
+        """Computes only the outputs the request asks for, all of them when it names none."""
+        requested = set(request.requested_output_names or OUTPUT_NAMES)
 
         results = []
-        for processed_image in processed_images:
-            _, mask = self.model.predict(processed_image)
-            results.append(mask.cpu().numpy())
+        packed_masks = []
+        probabilities = []
+        for image in request["images"]:
+            processed_image = Image.fromarray(image)
+            with_mask = "masks" in requested or "packed_masks" in requested
+            logits, mask = self.model.predict(processed_image, with_mask)
+            if with_mask:
+                mask = mask.cpu().numpy()
+            if "masks" in requested:
+                results.append(mask)
+            if "packed_masks" in requested:
+                packed_masks.append(
+                    self._pack_mask(mask, self._mask_bits(self.num_classes))
+                )
+            if "probabilities" in requested:
+                probabilities.append(
+                    self._quarter_probabilities(logits, processed_image.size)
+                )
+
+        outputs = {}
+        if "masks" in requested:
+            outputs["masks"] = np.array(results, dtype=np.uint8)
+        if "packed_masks" in requested:
+            outputs["packed_masks"] = np.array(packed_masks, dtype=np.uint8)
+        if "probabilities" in requested:
+            outputs["probabilities"] = np.array(probabilities, dtype=np.float16)
+        return outputs
+
+    @staticmethod
+    def _mask_bits(num_classes: int) -> int:
+        """Bits per pixel of a packed mask, the fewest of 1, 2, 4 or 8 that hold every class."""
+        return next(bits for bits in (1, 2, 4, 8) if num_classes <= 1 << bits)
 
-        return {
-            "masks": np.array(results, dtype=np.uint8),
-        }
+    @staticmethod
+    def _pack_mask(mask: np.ndarray, bits: int) -> np.ndarray:
+        """Packs a mask row-major at bits per pixel, each byte's first pixel in its lowest bits."""
+        per_byte = 8 // bits
+        labels = mask.reshape(-1).astype(np.uint8)
+        labels = np.pad(labels, (0, -labels.size % per_byte))
+        shifts = np.arange(per_byte, dtype=np.uint8) * bits
+        return np.bitwise_or.reduce(
+            labels.reshape(-1, per_byte) << shifts, axis=1
+        ).astype(np.uint8)
+
+    @staticmethod
+    def _quarter_probabilities(logits: torch.Tensor, size) -> np.ndarray:
+        """Class probabilities at a quarter of the input resolution, (H/4, W/4, C)."""
+        width, height = size
+        target_size = ((height + 3) // 4, (width + 3) // 4)
+        probabilities = torch.nn.functional.interpolate(
+            logits.unsqueeze(0), size=target_size, mode="bilinear", align_corners=False
+        )[0].softmax(dim=0)
+        return probabilities.permute(1, 2, 0).half().cpu().numpy()
 
 
 def multi_device_factory(
@@ -85,15 +137,23 @@ def main():
     # Start Triton Inference Server
     with Triton() as triton:
         logging.info("Loading models...")
+        infer_funcs = multi_device_factory(
+            detector_id=args.model_id,
+            cache_dir=args.cache_dir,
+        )
+        num_classes = infer_funcs[0].num_classes
         triton.bind(
             model_name="Segmenter",
-            infer_func=multi_device_factory(
-                detector_id=args.model_id,
-                cache_dir=args.cache_dir,
-            ),
+            infer_func=infer_funcs,
             inputs=[Tensor(name="images", dtype=np.uint8, shape=(-1, -1, 3))],
             outputs=[
-                Tensor(name="masks", dtype=np.uint8, shape=(-1, -1))  # Masks (H, W)
+                Tensor(name="masks", dtype=np.uint8, shape=(-1, -1)),  # Masks (H, W)
+                Tensor(
+                    name="packed_masks", dtype=np.uint8, shape=(-1,)
+                ),  # Masks at 1, 2, 4 or 8 bits per pixel
+                Tensor(
+                    name="probabilities", dtype=np.float16, shape=(-1, -1, num_classes)
+                ),  # Class probabilities (H/4, W/4, C), C telling clients the classes
             ],
             config=ModelConfig(
                 max_batch_size=args.max_batch_size,